@@ -0,0 +1,348 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-10-18 09:41:05
+ * @ Modified time: 2024-10-18 09:41:05
+ * @ Description: Usable CPU detection (affinity mask, SMT siblings, cgroup quota) and pinning.
+ */
+
+#define _GNU_SOURCE
+#include "affinity.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct
+{
+    int count;
+    int cpus[QCAD_MAX_CPUS];
+} allowed;
+
+static pthread_once_t allowed_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Parses a cpulist ("0-3,8,10-11", the sysfs and taskset format) into at most max
+ *        CPU ids. Returns their number.
+ */
+int qcad_parse_cpulist(const char *list, int *cpus, int max)
+{
+    int count = 0;
+    while (*list != '\0' && *list != '\n')
+    {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list)
+        {
+            break;
+        }
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        for (long cpu = first; cpu <= last && count < max; cpu++)
+        {
+            cpus[count++] = (int)cpu;
+        }
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+static void allowed_init(void)
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        allowed.cpus[allowed.count++] = 0;
+        return;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && allowed.count < QCAD_MAX_CPUS; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set))
+        {
+            allowed.cpus[allowed.count++] = cpu;
+        }
+    }
+}
+
+/**
+ * @brief Copies the CPUs of the process's affinity mask, in ascending order, into cpus.
+ *        Returns their number.
+ */
+int qcad_allowed_cpus(int *cpus, int max)
+{
+    pthread_once(&allowed_once, allowed_init);
+    int n = (allowed.count < max) ? allowed.count : max;
+    memcpy(cpus, allowed.cpus, n * sizeof(int));
+    return n;
+}
+
+/**
+ * @brief Returns the first CPU of the SMT siblings of cpu, or cpu itself when the topology is
+ *        not available.
+ */
+static int first_sibling(int cpu)
+{
+    char path[96], list[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return cpu;
+    }
+    int first = cpu;
+    if (fgets(list, sizeof(list), f) != NULL)
+    {
+        int siblings[64];
+        int n = qcad_parse_cpulist(list, siblings, 64);
+        for (int i = 0; i < n; i++)
+        {
+            first = (siblings[i] < first) ? siblings[i] : first;
+        }
+    }
+    fclose(f);
+    return first;
+}
+
+/**
+ * @brief CPUs the pool may run on: the allowed CPUs that are in mask (a cpulist, NULL for
+ *        all of them), in ascending order.
+ *
+ * With avoid_smt, only the first allowed hardware thread of each physical core is kept, so
+ * that two threads never share the execution units of one core. Returns the number of CPUs.
+ */
+int qcad_usable_cpus(const char *mask, int avoid_smt, int *cpus, int max)
+{
+    int listed[QCAD_MAX_CPUS], candidates[QCAD_MAX_CPUS], cores[QCAD_MAX_CPUS];
+    int ncandidates = qcad_allowed_cpus(candidates, QCAD_MAX_CPUS);
+    int nlisted = (mask != NULL) ? qcad_parse_cpulist(mask, listed, QCAD_MAX_CPUS) : 0;
+    int count = 0;
+    for (int i = 0; i < ncandidates && count < max; i++)
+    {
+        int cpu = candidates[i];
+        int keep = (mask == NULL);
+        for (int j = 0; j < nlisted && !keep; j++)
+        {
+            keep = (listed[j] == cpu);
+        }
+        int core = (keep && avoid_smt) ? first_sibling(cpu) : cpu;
+        for (int j = 0; j < count && keep && avoid_smt; j++)
+        {
+            keep = (cores[j] != core); // a sibling already taken means this core is used
+        }
+        if (keep)
+        {
+            cores[count] = core;
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Reads the CPU limit of one cgroup: "quota period" from a v2 cpu.max, or the v1
+ *        quota and period files. Returns 0 when it is missing or unlimited.
+ */
+static int read_quota(const char *quota_path, const char *period_path)
+{
+    long long quota = 0, period = 0;
+    char value[64];
+    FILE *f = fopen(quota_path, "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    if (fgets(value, sizeof(value), f) != NULL)
+    {
+        // cgroup v2 cpu.max holds both, "max" when unlimited; v1 uses two files, -1 when unlimited
+        char *end;
+        quota = strtoll(value, &end, 10);
+        if (end == value)
+        {
+            quota = 0;
+        }
+        period = strtoll(end, NULL, 10);
+    }
+    fclose(f);
+    if (period_path != NULL && (f = fopen(period_path, "r")) != NULL)
+    {
+        if (fgets(value, sizeof(value), f) != NULL)
+        {
+            period = strtoll(value, NULL, 10);
+        }
+        fclose(f);
+    }
+    if (quota <= 0 || period <= 0)
+    {
+        return 0;
+    }
+    return (int)((quota + period - 1) / period);
+}
+
+/**
+ * @brief Returns 1 when the comma-separated list contains token.
+ */
+static int has_token(const char *list, const char *token)
+{
+    size_t n = strlen(token);
+    while (*list != '\0')
+    {
+        size_t len = strcspn(list, ",");
+        if (len == n && strncmp(list, token, n) == 0)
+        {
+            return 1;
+        }
+        list += (list[len] == ',') ? len + 1 : len;
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the mount of a cgroup hierarchy in /proc/self/mountinfo: the v1 hierarchy
+ *        holding controller, or the v2 one when controller is NULL. Sets its mount point and
+ *        the cgroup path mounted there (not "/" inside containers without a cgroup namespace).
+ *        Returns 0 when it is not mounted.
+ */
+static int cgroup_mount(const char *controller, char mount[256], char root[256])
+{
+    char line[1024];
+    int found = 0;
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), f) != NULL)
+    {
+        // id parent major:minor root mount-point options [optional...] - fstype source super-options
+        char fstype[32], options[512];
+        const char *tail = strstr(line, " - ");
+        if (tail == NULL || sscanf(line, "%*d %*d %*s %255s %255s", root, mount) != 2 ||
+            sscanf(tail, " - %31s %*s %511s", fstype, options) != 2)
+        {
+            continue;
+        }
+        found = (controller == NULL) ? strcmp(fstype, "cgroup2") == 0
+                                     : strcmp(fstype, "cgroup") == 0 && has_token(options, controller);
+    }
+    fclose(f);
+    return found;
+}
+
+/**
+ * @brief Smallest CPU limit on the way from the cgroup at path up to the root of its
+ *        hierarchy: a quota set on a parent cgroup (e.g. on a container) caps its children.
+ */
+static int cgroup_limit(const char *controller, const char *path)
+{
+    char mount[256], root[256], dir[768];
+    if (!cgroup_mount(controller, mount, root))
+    {
+        return 0;
+    }
+    size_t rootlen = strlen(root);
+    if (strcmp(root, "/") != 0 && strncmp(path, root, rootlen) == 0)
+    {
+        path += rootlen;
+    }
+    size_t base = strlen(mount);
+    snprintf(dir, sizeof(dir), "%s%s", mount, path);
+    int best = 0;
+    for (;;)
+    {
+        while (strlen(dir) > base && dir[strlen(dir) - 1] == '/')
+        {
+            dir[strlen(dir) - 1] = '\0';
+        }
+        char quota[800], period[800];
+        int limit;
+        if (controller == NULL)
+        {
+            snprintf(quota, sizeof(quota), "%s/cpu.max", dir);
+            limit = read_quota(quota, NULL);
+        }
+        else
+        {
+            snprintf(quota, sizeof(quota), "%s/cpu.cfs_quota_us", dir);
+            snprintf(period, sizeof(period), "%s/cpu.cfs_period_us", dir);
+            limit = read_quota(quota, period);
+        }
+        best = (limit > 0 && (best == 0 || limit < best)) ? limit : best;
+        if (strlen(dir) <= base)
+        {
+            break;
+        }
+        *strrchr(dir, '/') = '\0';
+    }
+    return best;
+}
+
+/**
+ * @brief Returns the number of CPUs the CFS quota of the process's cgroup pays for, rounded
+ *        up, or 0 when there is no quota.
+ *
+ * The cgroup of the process is taken from /proc/self/cgroup: the hierarchy of the v1 cpu
+ * controller (cpu.cfs_quota_us / cpu.cfs_period_us) when there is one, else the v2 hierarchy
+ * (cpu.max). The smallest quota of the cgroup and its ancestors applies.
+ */
+int qcad_cgroup_cpu_limit(void)
+{
+    char line[1024], v1[512] = "", v2[512] = "";
+    int has_v1 = 0, has_v2 = 0;
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        // hierarchy-id:controllers:path, controllers empty for v2
+        line[strcspn(line, "\n")] = '\0';
+        char *controllers = strchr(line, ':');
+        char *path = (controllers != NULL) ? strchr(controllers + 1, ':') : NULL;
+        if (path == NULL)
+        {
+            continue;
+        }
+        *path++ = '\0';
+        controllers++;
+        if (*controllers == '\0')
+        {
+            snprintf(v2, sizeof(v2), "%s", path);
+            has_v2 = 1;
+        }
+        else if (has_token(controllers, "cpu"))
+        {
+            snprintf(v1, sizeof(v1), "%s", path);
+            has_v1 = 1;
+        }
+    }
+    fclose(f);
+    int limit = has_v1 ? cgroup_limit("cpu", v1) : 0;
+    if (limit == 0 && has_v2)
+    {
+        limit = cgroup_limit(NULL, v2);
+    }
+    return limit;
+}
+
+/**
+ * @brief Restricts the calling thread to the given CPUs.
+ */
+void qcad_pin_thread(const int *cpus, int n)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < n; i++)
+    {
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+        {
+            CPU_SET(cpus[i], &set);
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
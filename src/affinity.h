@@ -0,0 +1,20 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/*
+ * CPU discovery and thread pinning for the worker pool.
+ *
+ * The CPUs a process may use are those of its affinity mask (taskset, cpusets), captured
+ * the first time it is asked for so that later pinning of the calling thread does not
+ * shrink it. qcad_usable_cpus narrows them with a cpulist and can keep one hardware thread
+ * per physical core; qcad_cgroup_cpu_limit reports the CPU quota of the process's cgroup,
+ * which caps the useful thread count without restricting the mask.
+ */
+#define QCAD_MAX_CPUS 1024
+
+int qcad_parse_cpulist(const char *list, int *cpus, int max);
+int qcad_allowed_cpus(int *cpus, int max);
+int qcad_usable_cpus(const char *mask, int avoid_smt, int *cpus, int max);
+int qcad_cgroup_cpu_limit(void);
+void qcad_pin_thread(const int *cpus, int n);
+#endif // AFFINITY_H
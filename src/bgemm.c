@@ -0,0 +1,341 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-09-20 09:12:41
+ * @ Modified time: 2024-09-20 09:12:41
+ * @ Description: Packed-bit GEMM (XOR/AND-popcount) and bit-level im2col.
+ */
+
+#include "bgemm.h"
+#include "popcount.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Micro-kernels. Each one accumulates an (mr x nr) tile of C over kc words of K. The
+ * mr rows of A and nr rows of B of a tile stay in L1 while every pair is reduced with
+ * the vectorized popcount kernels.
+ */
+static inline void bnn_kernel(int mr, int nr, int kc, const qtype *A, int lda, const qtype *B, int ldb, int *C, int ldc)
+{
+    for (int i = 0; i < mr; i++)
+    {
+        for (int j = 0; j < nr; j++)
+        {
+            C[i * ldc + j] += popcount_xor(A + i * lda, B + j * ldb, kc);
+        }
+    }
+}
+
+static inline void tbn_kernel(int mr, int nr, int kc, const qtype *A, int lda, const tblock *B, int ldb, int *C, int ldc)
+{
+    for (int i = 0; i < mr; i++)
+    {
+        for (int j = 0; j < nr; j++)
+        {
+            C[i * ldc + j] += popcount_tbn(A + i * lda, B + j * ldb, kc);
+        }
+    }
+}
+
+static inline void tnn_kernel(int mr, int nr, int kc, const tblock *A, int lda, const tblock *B, int ldb, int *C, int ldc)
+{
+    for (int i = 0; i < mr; i++)
+    {
+        for (int j = 0; j < nr; j++)
+        {
+            C[i * ldc + j] += popcount_tnn(A + i * lda, B + j * ldb, kc);
+        }
+    }
+}
+
+static void clear_c(int M, int N, int *C, int ldc)
+{
+    for (int m = 0; m < M; m++)
+    {
+        memset(C + m * ldc, 0, N * sizeof(int));
+    }
+}
+
+/**
+ * @brief Binary GEMM: C[m][n] = sum_k popcount(A[m][k] ^ B[n][k]).
+ *
+ * The result is the number of mismatching bits; the caller turns it into a +1/-1 dot
+ * product since only it knows how many bits of each row are valid.
+ *
+ * @param M Number of rows of A (output channels).
+ * @param N Number of rows of B (output pixels / samples).
+ * @param K Reduction length in qtype words.
+ * @param A Packed weights, row stride lda.
+ * @param B Packed activations, row stride ldb.
+ * @param C Output matrix, row stride ldc. It is overwritten.
+ */
+void bgemm_bnn(int M, int N, int K, const qtype *A, int lda, const qtype *B, int ldb, int *C, int ldc)
+{
+    clear_c(M, N, C, ldc);
+    for (int kb = 0; kb < K; kb += BGEMM_KC)
+    {
+        int kc = (K - kb < BGEMM_KC) ? K - kb : BGEMM_KC;
+        for (int mb = 0; mb < M; mb += BGEMM_MC)
+        {
+            int mc = (M - mb < BGEMM_MC) ? M - mb : BGEMM_MC;
+            for (int n = 0; n < N; n += BGEMM_NR)
+            {
+                int nr = (N - n < BGEMM_NR) ? N - n : BGEMM_NR;
+                for (int m = mb; m < mb + mc; m += BGEMM_MR)
+                {
+                    int mr = (mb + mc - m < BGEMM_MR) ? mb + mc - m : BGEMM_MR;
+                    bnn_kernel(mr, nr, kc, A + m * lda + kb, lda, B + n * ldb + kb, ldb, C + m * ldc + n, ldc);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Binary-weight x ternary-activation GEMM: C[m][n] = sum_k dot(A[m][k], B[n][k]).
+ *
+ * A weight bit of 1 stands for +1 and 0 for -1. Activations are planar (ldb in tblocks), so C
+ * is the signed dot product. The kernels only count positive products (see popcount_tbn);
+ * the nonzero count of each activation row is taken once at the end instead of once per
+ * weight row.
+ */
+void bgemm_tbn(int M, int N, int K, const qtype *A, int lda, const tblock *B, int ldb, int *C, int ldc)
+{
+    clear_c(M, N, C, ldc);
+    for (int kb = 0; kb < K; kb += BGEMM_KC)
+    {
+        int kc = (K - kb < BGEMM_KC) ? K - kb : BGEMM_KC;
+        for (int mb = 0; mb < M; mb += BGEMM_MC)
+        {
+            int mc = (M - mb < BGEMM_MC) ? M - mb : BGEMM_MC;
+            for (int n = 0; n < N; n += BGEMM_NR)
+            {
+                int nr = (N - n < BGEMM_NR) ? N - n : BGEMM_NR;
+                for (int m = mb; m < mb + mc; m += BGEMM_MR)
+                {
+                    int mr = (mb + mc - m < BGEMM_MR) ? mb + mc - m : BGEMM_MR;
+                    tbn_kernel(mr, nr, kc, A + m * lda + kb, lda, B + n * ldb + kb / TBLOCK_WORDS, ldb, C + m * ldc + n, ldc);
+                }
+            }
+        }
+    }
+    for (int n = 0; n < N; n++)
+    {
+        int nonzero = popcount_nonzero(B + n * ldb, K);
+        for (int m = 0; m < M; m++)
+        {
+            C[m * ldc + n] = 2 * C[m * ldc + n] - nonzero;
+        }
+    }
+}
+
+/**
+ * @brief Ternary GEMM: C[m][n] = sum_k dot(A[m][k], B[n][k]).
+ *
+ * Weights and activations are both planar (see bgemm_planar_tnn), lda and ldb in tblocks.
+ */
+void bgemm_tnn(int M, int N, int K, const tblock *A, int lda, const tblock *B, int ldb, int *C, int ldc)
+{
+    clear_c(M, N, C, ldc);
+    for (int kb = 0; kb < K; kb += BGEMM_KC)
+    {
+        int kc = (K - kb < BGEMM_KC) ? K - kb : BGEMM_KC;
+        for (int mb = 0; mb < M; mb += BGEMM_MC)
+        {
+            int mc = (M - mb < BGEMM_MC) ? M - mb : BGEMM_MC;
+            for (int n = 0; n < N; n += BGEMM_NR)
+            {
+                int nr = (N - n < BGEMM_NR) ? N - n : BGEMM_NR;
+                for (int m = mb; m < mb + mc; m += BGEMM_MR)
+                {
+                    int mr = (mb + mc - m < BGEMM_MR) ? mb + mc - m : BGEMM_MR;
+                    tnn_kernel(mr, nr, kc, A + m * lda + kb / TBLOCK_WORDS, lda, B + n * ldb + kb / TBLOCK_WORDS, ldb,
+                               C + m * ldc + n, ldc);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Reorders a row-major (M x K) packed weight matrix into blocks of r rows.
+ *
+ * Block b holds rows [b * r, b * r + r) with the reduction dimension outside and the r
+ * rows innermost: out[(b * K + k) * r + j] = A[(b * r + j) * K + k]. A register-blocked
+ * kernel thus finds the weights of r output channels for one input word in one contiguous
+ * load. Rows past M are zero.
+ *
+ * @return The prepacked matrix of ceil(M / r) * r * K words, freed with free().
+ */
+qtype *bgemm_prepack(const qtype *A, int M, int K, int r)
+{
+    int blocks = (M + r - 1) / r;
+    qtype *out = (qtype *)calloc((size_t)blocks * r * K, sizeof(qtype));
+    if (out == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for prepacked weights\n");
+        exit(1);
+    }
+    for (int m = 0; m < M; m++)
+    {
+        qtype *dst = out + (size_t)(m / r) * r * K + m % r;
+        for (int k = 0; k < K; k++)
+        {
+            dst[(size_t)k * r] = A[(size_t)m * K + k];
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief Ternary counterpart of bgemm_prepack. TNN weights (A1 = +1, A0 = -1) are stored as
+ *        nz and sign planes, interleaved per word: out[((b * K + k) * 2 + plane) * r + j].
+ *
+ * A kernel finds both planes of r output channels for one input word in one cache line
+ * (r = BGEMM_PACK_T), instead of in two separate streams.
+ *
+ * @return The prepacked matrix of ceil(M / r) * r * K * 2 words, freed with free().
+ */
+qtype *bgemm_prepack_tnn(const qtype *A0, const qtype *A1, int M, int K, int r)
+{
+    int blocks = (M + r - 1) / r;
+    size_t bytes = ((size_t)blocks * r * K * 2 * sizeof(qtype) + sizeof(tblock) - 1) / sizeof(tblock) * sizeof(tblock);
+    qtype *out = (qtype *)aligned_alloc(sizeof(tblock), bytes > 0 ? bytes : sizeof(tblock));
+    if (out == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for prepacked weights\n");
+        exit(1);
+    }
+    memset(out, 0, bytes);
+    for (int m = 0; m < M; m++)
+    {
+        qtype *dst = out + (size_t)(m / r) * r * K * 2 + m % r;
+        for (int k = 0; k < K; k++)
+        {
+            qtype w0 = A0[(size_t)m * K + k];
+            dst[(size_t)k * 2 * r] = w0 | A1[(size_t)m * K + k];
+            dst[(size_t)k * 2 * r + r] = w0;
+        }
+    }
+    return out;
+}
+
+static inline void tblock_store(tblock *row, int k, ttype v)
+{
+    row[k / TBLOCK_WORDS].nz[k % TBLOCK_WORDS] = v.nz;
+    row[k / TBLOCK_WORDS].sign[k % TBLOCK_WORDS] = v.sign;
+}
+
+/**
+ * @brief Converts a row-major (M x K) TNN weight matrix (A1 = +1, A0 = -1) to planar rows of
+ *        TBLOCKS(K) tblocks, the A operand of bgemm_tnn and popcount_tnn.
+ *
+ * @return The planar matrix, freed with free().
+ */
+tblock *bgemm_planar_tnn(const qtype *A0, const qtype *A1, int M, int K)
+{
+    size_t count = (size_t)M * TBLOCKS(K);
+    tblock *out = (tblock *)aligned_alloc(sizeof(tblock), (count > 0 ? count : 1) * sizeof(tblock));
+    if (out == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for planar weights\n");
+        exit(1);
+    }
+    memset(out, 0, count * sizeof(tblock));
+    for (int m = 0; m < M; m++)
+    {
+        for (int k = 0; k < K; k++)
+        {
+            ttype w = {A0[(size_t)m * K + k] | A1[(size_t)m * K + k], A0[(size_t)m * K + k]};
+            tblock_store(out + (size_t)m * TBLOCKS(K), k, w);
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief Converts n ttype words to TBLOCKS(n) planar tblocks.
+ */
+void bgemm_planar(const ttype *in, int n, tblock *out)
+{
+    memset(out, 0, TBLOCKS(n) * sizeof(tblock));
+    for (int k = 0; k < n; k++)
+    {
+        tblock_store(out, k, in[k]);
+    }
+}
+
+/*
+ * Bit-level im2col over the channel-last packed input [y][x][kc]. Row p of cols holds the
+ * receptive field of output pixel p0 + p in [ky][kx][kc] order, which is the order of the
+ * conv2d weights. Each tap is one contiguous run of inputq_size words. The input must be
+ * pre-padded (see packed_pad), so every tap is in bounds and the copy loop has no branch.
+ */
+#define DEFINE_BIT_IM2COL(name, T)                                                          \
+    void name(const T *input, int inputq_size, int input_width,                              \
+              int kernel_size, int stride, int dilation,                                     \
+              int output_width, int p0, int np, T *cols)                                     \
+    {                                                                                        \
+        int K = inputq_size * kernel_size * kernel_size;                                     \
+        size_t run = (size_t)inputq_size * sizeof(T);                                        \
+        for (int p = 0; p < np; p++)                                                         \
+        {                                                                                    \
+            int y = (p0 + p) / output_width;                                                 \
+            int x = (p0 + p) % output_width;                                                 \
+            T *row = cols + (size_t)p * K;                                                   \
+            for (int ky = 0; ky < kernel_size; ky++)                                         \
+            {                                                                                \
+                const T *src = input + ((size_t)(y * stride + ky * dilation) * input_width + \
+                                        x * stride) * inputq_size;                           \
+                if (dilation == 1)                                                           \
+                {                                                                            \
+                    /* the whole kernel row is one contiguous run */                         \
+                    memcpy(row, src, run * kernel_size);                                     \
+                    row += (size_t)inputq_size * kernel_size;                                \
+                    continue;                                                                \
+                }                                                                            \
+                for (int kx = 0; kx < kernel_size; kx++)                                     \
+                {                                                                            \
+                    memcpy(row, src + (size_t)kx * dilation * inputq_size, run);             \
+                    row += inputq_size;                                                      \
+                }                                                                            \
+            }                                                                                \
+        }                                                                                    \
+    }
+
+DEFINE_BIT_IM2COL(bit_im2col_b, qtype)
+
+/**
+ * @brief Ternary im2col. Same gather as bit_im2col_b, but each row of cols is written planar
+ *        as TBLOCKS(K) tblocks (see bgemm.h).
+ */
+void bit_im2col_t(const ttype *input, int inputq_size, int input_width,
+                  int kernel_size, int stride, int dilation,
+                  int output_width, int p0, int np, tblock *cols)
+{
+    int K = inputq_size * kernel_size * kernel_size;
+    int run = (dilation == 1) ? inputq_size * kernel_size : inputq_size;
+    for (int p = 0; p < np; p++)
+    {
+        int y = (p0 + p) / output_width;
+        int x = (p0 + p) % output_width;
+        tblock *row = cols + (size_t)p * TBLOCKS(K);
+        memset(row + TBLOCKS(K) - 1, 0, sizeof(tblock));
+        int k = 0;
+        for (int ky = 0; ky < kernel_size; ky++)
+        {
+            const ttype *src = input + ((size_t)(y * stride + ky * dilation) * input_width + x * stride) * inputq_size;
+            // with dilation 1 the whole kernel row is one contiguous run
+            for (int kx = 0; kx < kernel_size; kx += run / inputq_size)
+            {
+                const ttype *tap = src + (size_t)kx * dilation * inputq_size;
+                for (int i = 0; i < run; i++, k++)
+                {
+                    tblock_store(row, k, tap[i]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef BGEMM_H
+#define BGEMM_H
+#include "utils.h"
+
+/*
+ * Packed-bit GEMM.
+ *
+ * A is the (M x K) weight matrix and B the (N x K) activation matrix, both stored
+ * row-major with the reduction dimension K (in qtype words) innermost, so that
+ * C[m * ldc + n] is the dot product of row m of A with row n of B.
+ *
+ * Ternary operands are planar: a row of K words is stored as TBLOCKS(K) tblocks, so one
+ * 256-bit load fetches TBLOCK_WORDS words of a plane, and both planes of a block share a
+ * cache line. Their row strides (lda / ldb) count tblocks; lanes past K are zero.
+ */
+#define BGEMM_MR 4   // output channels per micro-kernel call
+#define BGEMM_NR 4   // output pixels per micro-kernel call
+#define BGEMM_MC 64  // rows of A kept hot in L2
+#define BGEMM_KC (16384 / SIZEQUANT) // words of K per block (2 KiB of each row)
+
+// Output channels per prepacked weight block (see bgemm_prepack)
+#define BGEMM_PACK_B 8 // BNN: one popcount chain per channel
+#define BGEMM_PACK_T 4 // TBN/TNN: one or two popcount chains per channel
+
+void bgemm_bnn(int M, int N, int K, const qtype *A, int lda, const qtype *B, int ldb, int *C, int ldc);
+void bgemm_tbn(int M, int N, int K, const qtype *A, int lda, const tblock *B, int ldb, int *C, int ldc);
+void bgemm_tnn(int M, int N, int K, const tblock *A, int lda, const tblock *B, int ldb, int *C, int ldc);
+
+qtype *bgemm_prepack(const qtype *A, int M, int K, int r);
+qtype *bgemm_prepack_tnn(const qtype *A0, const qtype *A1, int M, int K, int r);
+tblock *bgemm_planar_tnn(const qtype *A0, const qtype *A1, int M, int K);
+void bgemm_planar(const ttype *in, int n, tblock *out);
+
+void bit_im2col_b(const qtype *input, int inputq_size, int input_width,
+                  int kernel_size, int stride, int dilation,
+                  int output_width, int p0, int np, qtype *cols);
+void bit_im2col_t(const ttype *input, int inputq_size, int input_width,
+                  int kernel_size, int stride, int dilation,
+                  int output_width, int p0, int np, tblock *cols);
+#endif // BGEMM_H
@@ -15,10 +15,691 @@
 #include "utils.h"
 #include "float.h"
 #include <stdint.h>
+#include "bgemm.h"
+#include "sgemm.h"
+#include "igemm.h"
+#include "popcount.h"
+#include "dispatch.h"
+#include "threadpool.h"
+#include "numa.h"
+#ifdef QCAD_X86
+#include <immintrin.h>
+#endif
 
 #include <time.h>
 #define RAND
-// #define MC
+#define CONV_NCHUNK 128 // output pixels gathered per im2col block
+#define CONV_FP_NCHUNK 1024 // output pixels per float im2col block
+/**
+ * @brief Clears the bits past input_channel in the last packed word of every weight row.
+ *
+ * The packed kernels count every bit of a word, so padding bits have to be zero on both
+ * the weight and the activation side for BNN results to be exact.
+ *
+ * @param weights Packed weights laid out (rows, inputq_size), e.g. rows = output channel * kernel taps.
+ */
+static void mask_channel_tail(qtype *weights, int rows, int inputq_size, int input_channel)
+{
+    if (input_channel % SIZEQUANT == 0)
+    {
+        return;
+    }
+    qtype tail = QMASK(input_channel % SIZEQUANT);
+    for (int r = 0; r < rows; r++)
+    {
+        weights[(size_t)r * inputq_size + inputq_size - 1] &= tail;
+    }
+}
+
+/*
+ * Direct quantized conv kernels specialized at compile time for the (kernel_size, stride)
+ * shapes of our models. With a channel-last padded input and [ky][kx][kc] weights, one
+ * kernel row of a dilation-1 window is a single contiguous run of K * inputq_size words on
+ * both sides, so a window is K inlined popcount reductions and no im2col copy is needed.
+ * The weights are read prepacked (conv2d_prepack), so every input word is loaded once for a
+ * whole block of output channels.
+ * K and S are constants, which unrolls the window loop and folds the address arithmetic.
+ * The results are raw like bgemm_*: mismatch counts for BNN, signed dot products for TBN/TNN.
+ *
+ * Each shape is built twice, for a popcnt target and for the generic one, and
+ * conv2d_select_kernel picks the variant matching the dispatched ISA. Windows longer than
+ * CONV_DIRECT_WORDS per output channel are reduced faster by the vectorized kernels behind
+ * the im2col path, which is why 11x11/s4 (AlexNet conv1) has no direct kernel.
+ */
+#define CONV_DIRECT_WORDS (2048 / SIZEQUANT)
+#define CONV2D_DIRECT_LOOP(K, S, R, ROW, STEP)                                             \
+    for (int cb = 0; cb < layer->output_channel; cb += R)                                  \
+    {                                                                                      \
+        for (int p = 0; p < np; p++)                                                       \
+        {                                                                                  \
+            int y = (p0 + p) / output_width;                                               \
+            int x = (p0 + p) % output_width;                                               \
+            size_t w = (size_t)cb * K * (ROW);                                             \
+            size_t in = (size_t)y * S * pitch + (size_t)x * S * q;                         \
+            int64_t sum[R] = {0};                                                          \
+            _Pragma("GCC unroll 16") for (int ky = 0; ky < K; ky++)                        \
+            {                                                                              \
+                for (int i = 0; i < (ROW); i++)                                            \
+                {                                                                          \
+                    STEP(w + (size_t)i * R, in + i);                                       \
+                }                                                                          \
+                w += (size_t)(ROW) * R;                                                    \
+                in += pitch;                                                               \
+            }                                                                              \
+            for (int r = 0; r < R && cb + r < layer->output_channel; r++)                  \
+            {                                                                              \
+                acc[(cb + r) * np + p] = (int)sum[r];                                      \
+            }                                                                              \
+        }                                                                                  \
+    }
+
+// Layers with at most SIZEQUANT input channels get a constant row length as well, so the
+// whole window is unrolled.
+#define CONV2D_DIRECT_ROWS(K, S, R, STEP)                                                  \
+    if (q == 1)                                                                            \
+        CONV2D_DIRECT_LOOP(K, S, R, K, STEP)                                               \
+    else                                                                                   \
+        CONV2D_DIRECT_LOOP(K, S, R, row, STEP)
+
+#define CONV2D_XOR_STEP(wi, ii) xor_block(sum, BGEMM_PACK_B, layer->packed_b + (wi), padded->b[ii])
+#define CONV2D_TBN_STEP(wi, ii) tbn_block(sum, BGEMM_PACK_T, layer->packed_b + (wi), padded->t[ii])
+#define CONV2D_TNN_STEP(wi, ii) tnn_block(sum, BGEMM_PACK_T, layer->packed_t + 2 * (wi), padded->t[ii])
+
+#define DEFINE_CONV2D_DIRECT(K, S, SUFFIX, ATTR)                                           \
+    ATTR static void conv2d_direct_k##K##_s##S##SUFFIX(const conv2d_layer *layer,          \
+                                                       const packed_tensor *padded,        \
+                                                       int output_width, int p0, int np,   \
+                                                       int *acc)                           \
+    {                                                                                      \
+        int q = padded->words;                                                             \
+        int row = K * q;                                                                   \
+        size_t pitch = (size_t)padded->width * q;                                          \
+        switch (layer->quant)                                                              \
+        {                                                                                  \
+        case BNN:                                                                          \
+            CONV2D_DIRECT_ROWS(K, S, BGEMM_PACK_B, CONV2D_XOR_STEP)                        \
+            break;                                                                         \
+        case TBN:                                                                          \
+            CONV2D_DIRECT_ROWS(K, S, BGEMM_PACK_T, CONV2D_TBN_STEP)                        \
+            break;                                                                         \
+        case TNN:                                                                          \
+            CONV2D_DIRECT_ROWS(K, S, BGEMM_PACK_T, CONV2D_TNN_STEP)                        \
+            break;                                                                         \
+        default:                                                                           \
+            break;                                                                         \
+        }                                                                                  \
+    }
+
+#ifdef QCAD_X86
+#define CONV2D_POPCNT __attribute__((target("popcnt")))
+#else
+#define CONV2D_POPCNT
+#endif
+
+DEFINE_CONV2D_DIRECT(3, 1, , )
+DEFINE_CONV2D_DIRECT(5, 1, , )
+DEFINE_CONV2D_DIRECT(3, 1, _popcnt, CONV2D_POPCNT)
+DEFINE_CONV2D_DIRECT(5, 1, _popcnt, CONV2D_POPCNT)
+
+/*
+ * Register-blocked direct micro-kernel for any (kernel_size, stride, dilation). Each call of
+ * the tile loop computes pack_block output channels x CONV_TILE_PIXELS output pixels: every
+ * weight word is shared by the pixels of the tile and every input word by the channels of
+ * the block, and the pack_block * CONV_TILE_PIXELS popcount chains are independent, which
+ * hides the popcnt latency. The input row of the next kernel row is prefetched while the
+ * current one is reduced.
+ *
+ * It replaces im2col + bgemm for small spatial outputs (CONV_DIRECT_PIXELS, e.g. AlexNet
+ * 13x13 or VGG 14x14/7x7), where gathering the receptive fields costs more than the GEMM
+ * saves, as long as the dispatched ISA has no AVX2. The AVX2 Harley-Seal reduction behind
+ * bgemm still beats per-word popcnt on those layers' long (>= 36 word) windows.
+ */
+#define CONV_TILE_PIXELS 2
+#define CONV_DIRECT_PIXELS 256
+
+#define CONV2D_TILE_LOOP(R, STEP)                                                          \
+    for (int cb = 0; cb < layer->output_channel; cb += R)                                  \
+    {                                                                                      \
+        for (int p = 0; p < np; p += CONV_TILE_PIXELS)                                     \
+        {                                                                                  \
+            size_t in[CONV_TILE_PIXELS];                                                   \
+            for (int j = 0; j < CONV_TILE_PIXELS; j++)                                     \
+            {                                                                              \
+                /* a tail tile repeats its last pixel, whose results are dropped */        \
+                int pixel = p0 + (p + j < np ? p + j : np - 1);                            \
+                int y = pixel / output_width;                                              \
+                int x = pixel % output_width;                                              \
+                in[j] = (size_t)y * stride * pitch + (size_t)x * stride * q;               \
+            }                                                                              \
+            int64_t sum[CONV_TILE_PIXELS][R] = {{0}};                                      \
+            size_t w = (size_t)cb * K;                                                     \
+            for (int ky = 0; ky < kernel_size; ky++)                                       \
+            {                                                                              \
+                size_t row = (size_t)ky * dilation * pitch;                                \
+                for (int j = 0; j < CONV_TILE_PIXELS; j++)                                 \
+                {                                                                          \
+                    __builtin_prefetch(base + in[j] + row + dilation * pitch);             \
+                }                                                                          \
+                for (int kx = 0; kx < kernel_size; kx++)                                   \
+                {                                                                          \
+                    size_t tap = row + (size_t)kx * dilation * q;                          \
+                    for (int i = 0; i < q; i++)                                            \
+                    {                                                                      \
+                        for (int j = 0; j < CONV_TILE_PIXELS; j++)                         \
+                        {                                                                  \
+                            STEP(sum[j], w, in[j] + tap + i);                              \
+                        }                                                                  \
+                        w += R;                                                            \
+                    }                                                                      \
+                }                                                                          \
+            }                                                                              \
+            for (int j = 0; j < CONV_TILE_PIXELS && p + j < np; j++)                       \
+            {                                                                              \
+                for (int r = 0; r < R && cb + r < layer->output_channel; r++)              \
+                {                                                                          \
+                    acc[(cb + r) * np + p + j] = (int)sum[j][r];                           \
+                }                                                                          \
+            }                                                                              \
+        }                                                                                  \
+    }
+
+#define CONV2D_TILE_XOR(sum, wi, ii) xor_block(sum, BGEMM_PACK_B, layer->packed_b + (wi), padded->b[ii])
+#define CONV2D_TILE_TBN(sum, wi, ii) tbn_block(sum, BGEMM_PACK_T, layer->packed_b + (wi), padded->t[ii])
+#define CONV2D_TILE_TNN(sum, wi, ii) tnn_block(sum, BGEMM_PACK_T, layer->packed_t + 2 * (wi), padded->t[ii])
+
+#define DEFINE_CONV2D_TILE(SUFFIX, ATTR)                                                   \
+    ATTR static void conv2d_direct_tile##SUFFIX(const conv2d_layer *layer,                 \
+                                                const packed_tensor *padded,               \
+                                                int output_width, int p0, int np, int *acc) \
+    {                                                                                      \
+        int q = padded->words;                                                             \
+        int kernel_size = layer->kernel_size;                                              \
+        int stride = layer->stride;                                                        \
+        int dilation = layer->dilation;                                                    \
+        size_t K = (size_t)kernel_size * kernel_size * q;                                  \
+        size_t pitch = (size_t)padded->width * q;                                          \
+        switch (layer->quant)                                                              \
+        {                                                                                  \
+        case BNN:                                                                          \
+        {                                                                                  \
+            const qtype *base = padded->b;                                                 \
+            CONV2D_TILE_LOOP(BGEMM_PACK_B, CONV2D_TILE_XOR)                                \
+            break;                                                                         \
+        }                                                                                  \
+        case TBN:                                                                          \
+        {                                                                                  \
+            const ttype *base = padded->t;                                                 \
+            CONV2D_TILE_LOOP(BGEMM_PACK_T, CONV2D_TILE_TBN)                                \
+            break;                                                                         \
+        }                                                                                  \
+        case TNN:                                                                          \
+        {                                                                                  \
+            const ttype *base = padded->t;                                                 \
+            CONV2D_TILE_LOOP(BGEMM_PACK_T, CONV2D_TILE_TNN)                                \
+            break;                                                                         \
+        }                                                                                  \
+        default:                                                                           \
+            break;                                                                         \
+        }                                                                                  \
+    }
+
+DEFINE_CONV2D_TILE(, )
+DEFINE_CONV2D_TILE(_popcnt, CONV2D_POPCNT)
+
+typedef void (*conv2d_direct_fn)(const conv2d_layer *, const packed_tensor *, int, int, int, int *);
+
+/**
+ * @brief Kernel used for one forward pass: the layer's specialized kernel, the register-blocked
+ *        tile kernel for small outputs, or NULL for im2col + bgemm.
+ */
+static conv2d_direct_fn conv2d_forward_kernel(const conv2d_layer *layer, int output_height, int output_width)
+{
+    if (layer->kernel != NULL)
+        return layer->kernel;
+    qcad_isa isa = qcad_get_kernels()->isa;
+    if ((layer->quant != BNN && layer->quant != TBN && layer->quant != TNN) || isa == QCAD_ISA_AVX2 ||
+        output_height * output_width > CONV_DIRECT_PIXELS)
+        return NULL;
+    return (isa == QCAD_ISA_SSE42) ? conv2d_direct_tile_popcnt : conv2d_direct_tile;
+}
+
+/**
+ * @brief Picks the specialized kernel of a quantized layer, or NULL for the generic path.
+ */
+static conv2d_direct_fn conv2d_select_kernel(const conv2d_layer *layer)
+{
+    int inputq_size = (layer->input_channel % SIZEQUANT) ? (layer->input_channel / SIZEQUANT + 1) : (layer->input_channel / SIZEQUANT);
+    if ((layer->quant != BNN && layer->quant != TBN && layer->quant != TNN) || layer->dilation != 1 ||
+        layer->kernel_size * layer->kernel_size * inputq_size > CONV_DIRECT_WORDS)
+        return NULL;
+    int popcnt = qcad_get_kernels()->isa != QCAD_ISA_SCALAR;
+    if (layer->kernel_size == 3 && layer->stride == 1)
+        return popcnt ? conv2d_direct_k3_s1_popcnt : conv2d_direct_k3_s1;
+    if (layer->kernel_size == 5 && layer->stride == 1)
+        return popcnt ? conv2d_direct_k5_s1_popcnt : conv2d_direct_k5_s1;
+    return NULL;
+}
+
+/**
+ * @brief Weight buffers read by the forward pass of a prepacked layer, as (field, size in
+ *        bytes) pairs. Returns their number.
+ */
+static int conv2d_weight_buffers(conv2d_layer *layer, void **fields[2], size_t sizes[2])
+{
+    size_t taps = (size_t)layer->kernel_size * layer->kernel_size;
+    size_t K = taps * ((layer->input_channel + SIZEQUANT - 1) / SIZEQUANT);
+    size_t co = layer->output_channel;
+    size_t blocked = (layer->pack_block > 0) ? (co + layer->pack_block - 1) / layer->pack_block * layer->pack_block : co;
+    int n = 0;
+    switch (layer->quant)
+    {
+    case BNN:
+    case TBN:
+        fields[n] = (void **)&layer->weights_b;
+        sizes[n++] = co * K * sizeof(qtype);
+        fields[n] = (void **)&layer->packed_b;
+        sizes[n++] = blocked * K * sizeof(qtype);
+        break;
+    case TNN:
+        fields[n] = (void **)&layer->packed_t;
+        sizes[n++] = blocked * K * 2 * sizeof(qtype);
+        fields[n] = (void **)&layer->weights_tp;
+        sizes[n++] = co * TBLOCKS(K) * sizeof(tblock);
+        break;
+    case FP:
+        fields[n] = (void **)&layer->weights_f;
+        sizes[n++] = co * layer->input_channel * taps * sizeof(float);
+        if (layer->weights_wino != NULL)
+        {
+            fields[n] = (void **)&layer->weights_wino;
+            sizes[n++] = 16 * co * layer->input_channel * sizeof(float);
+        }
+        break;
+    case INT8:
+        fields[n] = (void **)&layer->weights_q;
+        sizes[n++] = co * IGEMM_STRIDE(layer->input_channel * taps);
+        break;
+    case MBIT:
+        fields[n] = (void **)&layer->weights_planes;
+        sizes[n++] = (size_t)layer->weight_bits * co * K * sizeof(qtype);
+        break;
+    default:
+        break;
+    }
+    return n;
+}
+
+/**
+ * @brief The layer as work items should read it: the layer itself, or with NUMA replicas
+ *        (see conv2d_numa_place) a copy in view holding the weight buffers local to the
+ *        calling thread's node.
+ *
+ * Replicas are only written by conv2d_prepack, so concurrent regions on one layer never race
+ * on them, and fields set on the layer afterwards (e.g. input_thres, out_thres) are read
+ * from the layer itself.
+ */
+static const conv2d_layer *conv2d_local(const conv2d_layer *layer, conv2d_layer *view)
+{
+    if (layer->replicas == NULL)
+    {
+        return layer;
+    }
+    conv2d_layer *copy = layer->replicas[qcad_numa_node()];
+    *view = *layer;
+    void **fields[2], **local[2];
+    size_t sizes[2];
+    int n = conv2d_weight_buffers(view, fields, sizes);
+    conv2d_weight_buffers(copy, local, sizes);
+    for (int i = 0; i < n; i++)
+    {
+        *fields[i] = *local[i];
+    }
+    return view;
+}
+
+/*
+ * Winograd F(2x2, 3x3) for FP 3x3 stride-1 layers. Each 2x2 output tile is computed from a
+ * 4x4 input tile d as A^T [(G g G^T) .* (B^T d B)] A, i.e. 16 multiplies instead of 36.
+ * Over all channels and tiles the elementwise products become 16 independent GEMMs,
+ * M[xi] (output channel x tiles) = U[xi] (output channel x input channel) * V[xi]
+ * (input channel x tiles), which run through sgemm. U is computed once by conv2d_prepack.
+ */
+#define WINO_TCHUNK 256 // tiles transformed per block
+// Below these sizes the transforms (few channels) or the per-GEMM packing (few tiles)
+// cost more than the saved multiplies and im2col + sgemm is used instead
+#define WINO_MIN_CHANNELS 16
+#define WINO_MIN_TILES 64
+
+static int conv2d_use_winograd(const conv2d_layer *layer)
+{
+    return layer->quant == FP && layer->kernel_size == 3 && layer->stride == 1 && layer->dilation == 1;
+}
+
+/**
+ * @brief U = G g G^T of every (output channel, input channel) kernel, laid out (16, co, ci).
+ */
+static float *winograd_weights(const conv2d_layer *layer)
+{
+    int co_n = layer->output_channel;
+    int ci_n = layer->input_channel;
+    float *U = (float *)malloc((size_t)16 * co_n * ci_n * sizeof(float));
+    if (U == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for Winograd weights\n");
+        exit(1);
+    }
+    for (int co = 0; co < co_n; co++)
+    {
+        for (int ci = 0; ci < ci_n; ci++)
+        {
+            const float *g = layer->weights_f + ((size_t)co * ci_n + ci) * 9;
+            float t[4][3]; // G g
+            for (int j = 0; j < 3; j++)
+            {
+                t[0][j] = g[j];
+                t[1][j] = 0.5f * (g[j] + g[3 + j] + g[6 + j]);
+                t[2][j] = 0.5f * (g[j] - g[3 + j] + g[6 + j]);
+                t[3][j] = g[6 + j];
+            }
+            for (int i = 0; i < 4; i++) // (G g) G^T
+            {
+                float u[4] = {t[i][0], 0.5f * (t[i][0] + t[i][1] + t[i][2]), 0.5f * (t[i][0] - t[i][1] + t[i][2]), t[i][2]};
+                for (int j = 0; j < 4; j++)
+                {
+                    U[((size_t)(i * 4 + j) * co_n + co) * ci_n + ci] = u[j];
+                }
+            }
+        }
+    }
+    return U;
+}
+
+/**
+ * @brief V = B^T d B of the 4x4 input tiles t0 .. t0 + nt of one channel, zero outside the
+ *        input. V holds row ci of the 16 (input channel x nt) matrices.
+ */
+static void winograd_input(const float *plane, int input_height, int input_width, int padding, int tiles_w,
+                           int t0, int nt, float *V, size_t stride_xi)
+{
+    for (int t = 0; t < nt; t++)
+    {
+        int y0 = ((t0 + t) / tiles_w) * 2 - padding;
+        int x0 = ((t0 + t) % tiles_w) * 2 - padding;
+        float d[4][4];
+        for (int i = 0; i < 4; i++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                int y = y0 + i, x = x0 + j;
+                d[i][j] = (y >= 0 && x >= 0 && y < input_height && x < input_width) ? plane[y * input_width + x] : 0.0f;
+            }
+        }
+        float b[4][4]; // B^T d
+        for (int j = 0; j < 4; j++)
+        {
+            b[0][j] = d[0][j] - d[2][j];
+            b[1][j] = d[1][j] + d[2][j];
+            b[2][j] = d[2][j] - d[1][j];
+            b[3][j] = d[1][j] - d[3][j];
+        }
+        for (int i = 0; i < 4; i++) // (B^T d) B
+        {
+            V[(i * 4 + 0) * stride_xi + t] = b[i][0] - b[i][2];
+            V[(i * 4 + 1) * stride_xi + t] = b[i][1] + b[i][2];
+            V[(i * 4 + 2) * stride_xi + t] = b[i][2] - b[i][1];
+            V[(i * 4 + 3) * stride_xi + t] = b[i][1] - b[i][3];
+        }
+    }
+}
+
+typedef struct
+{
+    conv2d_layer *layer;
+    const float *input;
+    int input_height, input_width;
+    int output_height, output_width;
+    int tiles, tiles_w;
+    float *output;
+} winograd_job;
+
+/**
+ * @brief Runs the blocks [begin, end) of WINO_TCHUNK Winograd tiles.
+ */
+static void winograd_blocks(void *arg, int begin, int end)
+{
+    const winograd_job *job = (const winograd_job *)arg;
+    conv2d_layer view;
+    const conv2d_layer *layer = conv2d_local(job->layer, &view);
+    const float *input = job->input;
+    int input_height = job->input_height, input_width = job->input_width;
+    int output_height = job->output_height, output_width = job->output_width;
+    int co_n = layer->output_channel;
+    int ci_n = layer->input_channel;
+    int tiles = job->tiles, tiles_w = job->tiles_w;
+    float *output = job->output;
+    for (int t0 = begin * WINO_TCHUNK; t0 < tiles && t0 < end * WINO_TCHUNK; t0 += WINO_TCHUNK)
+    {
+        int nt = (tiles - t0 < WINO_TCHUNK) ? tiles - t0 : WINO_TCHUNK;
+        float *V = (float *)malloc((size_t)16 * ci_n * nt * sizeof(float));
+        float *M = (float *)malloc((size_t)16 * co_n * nt * sizeof(float));
+        if (V == NULL || M == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for Winograd buffers\n");
+            exit(1);
+        }
+        for (int ci = 0; ci < ci_n; ci++)
+        {
+            winograd_input(input + (size_t)ci * input_height * input_width, input_height, input_width, layer->padding,
+                           tiles_w, t0, nt, V + (size_t)ci * nt, (size_t)ci_n * nt);
+        }
+        for (int xi = 0; xi < 16; xi++)
+        {
+            sgemm(co_n, nt, ci_n, layer->weights_wino + (size_t)xi * co_n * ci_n, ci_n,
+                  V + (size_t)xi * ci_n * nt, nt, M + (size_t)xi * co_n * nt, nt);
+        }
+        for (int co = 0; co < co_n; co++)
+        {
+            float *out = output + (size_t)co * output_height * output_width;
+            for (int t = 0; t < nt; t++)
+            {
+                float m[16];
+                for (int xi = 0; xi < 16; xi++)
+                {
+                    m[xi] = M[((size_t)xi * co_n + co) * nt + t];
+                }
+                float a[2][4]; // A^T m
+                for (int j = 0; j < 4; j++)
+                {
+                    a[0][j] = m[j] + m[4 + j] + m[8 + j];
+                    a[1][j] = m[4 + j] - m[8 + j] - m[12 + j];
+                }
+                int y = ((t0 + t) / tiles_w) * 2;
+                int x = ((t0 + t) % tiles_w) * 2;
+                for (int i = 0; i < 2 && y + i < output_height; i++) // (A^T m) A
+                {
+                    out[(y + i) * output_width + x] = a[i][0] + a[i][1] + a[i][2];
+                    if (x + 1 < output_width)
+                        out[(y + i) * output_width + x + 1] = a[i][1] - a[i][2] - a[i][3];
+                }
+            }
+        }
+        free(V);
+        free(M);
+    }
+}
+
+/**
+ * @brief FP 3x3 stride-1 convolution in the Winograd domain, tiles processed in blocks of
+ *        WINO_TCHUNK spread over the thread pool.
+ */
+static void conv2d_forward_winograd(conv2d_layer *layer, const float *input, int input_height, int input_width,
+                                    int output_height, int output_width, float *output)
+{
+    int tiles_w = (output_width + 1) / 2;
+    int tiles = ((output_height + 1) / 2) * tiles_w;
+    winograd_job job = {layer, input, input_height, input_width, output_height, output_width, tiles, tiles_w, output};
+    qcad_parallel_for((tiles + WINO_TCHUNK - 1) / WINO_TCHUNK, 1, winograd_blocks, &job);
+}
+
+/**
+ * @brief Prepacks the quantized weights of a layer into blocks of pack_block output channels,
+ *        caches the Winograd weight transform of an FP 3x3 stride-1 layer, or quantizes the
+ *        float weights of an INT8 or MBIT (weight_bits digit planes) layer per output channel.
+ */
+static void conv2d_pack_weights(conv2d_layer *layer)
+{
+    if (layer->quant == MBIT)
+    {
+        if (layer->act_bits < 1 || layer->act_bits > MBIT_MAX_BITS || layer->weight_bits < 1 || layer->weight_bits > MBIT_MAX_BITS)
+        {
+            fprintf(stderr, "conv2d_prepack: MBIT bits must be in 1..%d\n", MBIT_MAX_BITS);
+            exit(1);
+        }
+        free(layer->weights_planes);
+        free(layer->plane_scale);
+        layer->plane_scale = (float *)malloc(layer->output_channel * sizeof(float));
+        if (layer->plane_scale == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for weight planes\n");
+            exit(1);
+        }
+        layer->weights_planes = pack_weight_planes(layer->weights_f, layer->output_channel, layer->input_channel,
+                                                   layer->kernel_size * layer->kernel_size, layer->weight_bits, layer->plane_scale);
+        return;
+    }
+    if (layer->quant == INT8)
+    {
+        free(layer->weights_q);
+        free(layer->weight_scale);
+        free(layer->weight_sum);
+        layer->weight_scale = (float *)malloc(layer->output_channel * sizeof(float));
+        layer->weight_sum = (int *)malloc(layer->output_channel * sizeof(int));
+        if (layer->weight_scale == NULL || layer->weight_sum == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for INT8 weights\n");
+            exit(1);
+        }
+        layer->weights_q = igemm_quantize_weights(layer->weights_f, layer->output_channel,
+                                                  layer->input_channel * layer->kernel_size * layer->kernel_size,
+                                                  layer->weight_scale, layer->weight_sum);
+        return;
+    }
+    if (layer->quant == FP)
+    {
+        if (conv2d_use_winograd(layer))
+        {
+            free(layer->weights_wino);
+            layer->weights_wino = winograd_weights(layer);
+        }
+        return;
+    }
+    int inputq_size = (layer->input_channel % SIZEQUANT) ? (layer->input_channel / SIZEQUANT + 1) : (layer->input_channel / SIZEQUANT);
+    int K = inputq_size * layer->kernel_size * layer->kernel_size;
+    free(layer->packed_b);
+    layer->pack_block = (layer->quant == BNN) ? BGEMM_PACK_B : BGEMM_PACK_T;
+    switch (layer->quant)
+    {
+    case BNN:
+    case TBN:
+        layer->packed_b = bgemm_prepack(layer->weights_b, layer->output_channel, K, layer->pack_block);
+        break;
+    case TNN:
+        free(layer->weights_tp);
+        layer->packed_t = bgemm_prepack_tnn(layer->weights_t0, layer->weights_t1, layer->output_channel, K, layer->pack_block);
+        layer->weights_tp = bgemm_planar_tnn(layer->weights_t0, layer->weights_t1, layer->output_channel, K);
+        break;
+    default:
+        break;
+    }
+}
+
+static void conv2d_numa_release(conv2d_layer *layer)
+{
+    if (layer->replicas == NULL)
+    {
+        return;
+    }
+    for (int node = 0; node < qcad_numa_nodes(); node++)
+    {
+        conv2d_layer *copy = layer->replicas[node];
+        if (node > 0 && copy == layer->replicas[node - 1])
+        {
+            continue; // interleaved: one copy shared by every node
+        }
+        void **fields[2];
+        size_t sizes[2];
+        int n = conv2d_weight_buffers(copy, fields, sizes);
+        for (int i = 0; i < n; i++)
+        {
+            free(*fields[i]);
+        }
+        free(copy);
+    }
+    free(layer->replicas);
+    layer->replicas = NULL;
+}
+
+/**
+ * @brief Rebuilds the node-local copies of the layer under the NUMA policy (see numa.h).
+ *
+ * REPLICATE gives every node a copy of the weight buffers, INTERLEAVE one copy shared by all
+ * nodes with its pages spread over them. Either way the original buffers stay untouched.
+ */
+static void conv2d_numa_place(conv2d_layer *layer)
+{
+    conv2d_numa_release(layer);
+    qcad_numa_policy policy = qcad_get_numa_policy();
+    int nodes = qcad_numa_nodes();
+    if (policy == QCAD_NUMA_OFF || nodes < 2)
+    {
+        return;
+    }
+    layer->replicas = (conv2d_layer **)malloc(nodes * sizeof(conv2d_layer *));
+    if (layer->replicas == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for layer replicas\n");
+        exit(1);
+    }
+    for (int node = 0; node < nodes; node++)
+    {
+        if (policy == QCAD_NUMA_INTERLEAVE && node > 0)
+        {
+            layer->replicas[node] = layer->replicas[0];
+            continue;
+        }
+        conv2d_layer *copy = (conv2d_layer *)malloc(sizeof(conv2d_layer));
+        if (copy == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for layer replicas\n");
+            exit(1);
+        }
+        *copy = *layer;
+        copy->replicas = NULL;
+        void **fields[2];
+        size_t sizes[2];
+        int n = conv2d_weight_buffers(copy, fields, sizes);
+        for (int i = 0; i < n; i++)
+        {
+            *fields[i] = (policy == QCAD_NUMA_REPLICATE) ? qcad_numa_copy(*fields[i], sizes[i], node)
+                                                         : qcad_numa_interleave(*fields[i], sizes[i]);
+        }
+        layer->replicas[node] = copy;
+    }
+}
+
+/**
+ * @brief Prepares the weights of a layer for the forward pass: conv2d_pack_weights, then the
+ *        NUMA placement of the buffers the forward pass reads (see numa.h).
+ *
+ * Runs at creation; call it again whenever the weights are overwritten (e.g. after loading
+ * a model) or the NUMA policy is changed. The original weights are kept unchanged for export.
+ */
+void conv2d_prepack(conv2d_layer *layer)
+{
+    conv2d_pack_weights(layer);
+    conv2d_numa_place(layer);
+}
+
 /**
  * @brief Creates and initializes a convolutional layer with specified parameters.
  *
@@ -36,6 +717,10 @@
  *              - BNN: Binary Neural Network
  *              - TBN: Ternary Binary Neural Network
  *              - TNN: Ternary Neural Network
+ *              - FP: Floating point
+ *              - INT8: 8-bit weights and activations, quantized from weights_f by conv2d_prepack
+ *              - MBIT: act_bits / weight_bits bit-serial activations and weights (2 / 2 by default;
+ *                call conv2d_prepack after changing them), weights quantized from weights_f
  *
  * @return A pointer to the initialized conv_layer structure. If memory allocation fails or an unknown
  *         quantization type is specified, the function prints an error message and terminates the program.
@@ -51,6 +736,7 @@ conv2d_layer *create_conv2d_layer(int input_channel, int output_channel, int ker
     layer->dilation = dilation;
 
     layer->input_thres = 0.0;
+    layer->out_thres = NULL;
     layer->quant = quant;
     int inputq_size = (input_channel % SIZEQUANT) == 0 ? (input_channel / SIZEQUANT) : (input_channel / SIZEQUANT + 1);
     int dim1 = output_channel;
@@ -63,7 +749,7 @@ conv2d_layer *create_conv2d_layer(int input_channel, int output_channel, int ker
     case BNN:
     case TBN:
         // layer->weights_b = allocate_4d_qtype_array(dim1, dim2, dim3, dim4);
-        layer->weights_b = (qtype*)malloc(dim1 * dim2 * dim3 * dim4 * sizeof(qtype*));
+        layer->weights_b = (qtype*)malloc(dim1 * dim2 * dim3 * dim4 * sizeof(qtype));
         if (layer->weights_b == NULL)
         {
             fprintf(stderr, "Memory allocation failed for weights\n");
@@ -71,20 +757,21 @@ conv2d_layer *create_conv2d_layer(int input_channel, int output_channel, int ker
         }
         #ifdef RAND
         for (int i = 0; i < dim1 * dim2 * dim3 * dim4; ++i) {
-            layer->weights_b[i] = (qtype)rand(); // Sinh số ngẫu nhiên giữa 0 và 1
+            layer->weights_b[i] = rand_qword(); // Sinh số ngẫu nhiên giữa 0 và 1
         }
+        mask_channel_tail(layer->weights_b, dim1 * dim3 * dim4, dim2, input_channel);
         #endif
         break;
         
     case TNN:
-        layer->weights_t0 = (qtype*)malloc(dim1 * dim2 * dim3 * dim4 * sizeof(qtype*));
+        layer->weights_t0 = (qtype*)malloc(dim1 * dim2 * dim3 * dim4 * sizeof(qtype));
         if (layer->weights_t0 == NULL)
         {
             fprintf(stderr, "Memory allocation failed for weights_0\n");
             exit(1);
         }
 
-        layer->weights_t1 = (qtype*)malloc(dim1 * dim2 * dim3 * dim4 * sizeof(qtype*));
+        layer->weights_t1 = (qtype*)malloc(dim1 * dim2 * dim3 * dim4 * sizeof(qtype));
         if (layer->weights_t1 == NULL)
         {
             fprintf(stderr, "Memory allocation failed for weights_1\n");
@@ -92,13 +779,17 @@ conv2d_layer *create_conv2d_layer(int input_channel, int output_channel, int ker
         }
         #ifdef RAND
         for (int i = 0; i < dim1 * dim2 * dim3 * dim4; ++i) {
-            layer->weights_t0[i] = (qtype)rand();
-            layer->weights_t1[i] = (qtype)rand();
+            layer->weights_t0[i] = rand_qword();
+            layer->weights_t1[i] = rand_qword() & ~layer->weights_t0[i];
         }
+        mask_channel_tail(layer->weights_t0, dim1 * dim3 * dim4, dim2, input_channel);
+        mask_channel_tail(layer->weights_t1, dim1 * dim3 * dim4, dim2, input_channel);
         #endif
         break;
 
     case FP:
+    case INT8:
+    case MBIT:
         // printf("%d \n", dim1 * dim2 * dim3 * dim4);
         layer->weights_f = (float*)malloc(dim1 * input_channel * dim3 * dim4 * sizeof(float*));
         if (layer->weights_f == NULL)
@@ -107,17 +798,897 @@ conv2d_layer *create_conv2d_layer(int input_channel, int output_channel, int ker
             exit(1);
         }
         #ifdef RAND
-        for (int i = 0; i < dim1 * dim2 * dim3 * dim4; ++i) {
+        for (int i = 0; i < dim1 * input_channel * dim3 * dim4; ++i) {
             layer->weights_f[i] = (float)rand();
 
         }
-        #endif
-        break;
-    default:
-        fprintf(stderr, "create_conv_layer: Unknown quantization type \n");
+        #endif
+        break;
+    default:
+        fprintf(stderr, "create_conv_layer: Unknown quantization type \n");
+        exit(1);
+    }
+    layer->pack_block = 0;
+    layer->packed_b = NULL;
+    layer->weights_tp = NULL;
+    layer->weight_sum = NULL;
+    layer->act_bits = 2;
+    layer->weight_bits = 2;
+    layer->replicas = NULL;
+    layer->kernel = conv2d_select_kernel(layer);
+    conv2d_prepack(layer);
+    return layer;
+}
+
+/*
+ * BNN and MBIT layers both multiply +1/-1 digits with XOR-popcount. An MBIT layer stacks its
+ * weight_bits digit planes as weight_bits * output_channel BNN weight rows (see
+ * pack_weight_planes).
+ */
+static int conv2d_xor_layer(const conv2d_layer *layer)
+{
+    return layer->quant == BNN || layer->quant == MBIT;
+}
+
+static int conv2d_rows(const conv2d_layer *layer)
+{
+    return (layer->quant == MBIT) ? layer->weight_bits * layer->output_channel : layer->output_channel;
+}
+
+static const qtype *conv2d_xor_weights(const conv2d_layer *layer)
+{
+    return (layer->quant == MBIT) ? layer->weights_planes : layer->weights_b;
+}
+
+/*
+ * BNN padding correction. BNN has no zero value, so the zero border added by packed_pad
+ * reads as +1 and padded taps have to be removed from the popcount again. Only border
+ * output pixels have padded taps, so their valid-tap counts and per-channel corrections are
+ * computed once per forward pass and interior pixels need no work at all.
+ */
+typedef struct {
+    int *id;    // (output height * output width), index into valid/corr or -1 for interior pixels
+    int *valid; // valid taps of each border pixel
+    int *corr;  // (border pixel, output channel) popcount of the weights on padded taps
+} conv2d_border;
+
+/**
+ * @brief Builds the BNN border table of a layer for one input size, with one correction per
+ *        weight row (see conv2d_rows). Returns NULL for ternary layers.
+ */
+static conv2d_border *conv2d_border_table(conv2d_layer *layer, int input_height, int input_width,
+                                          int output_height, int output_width)
+{
+    if (!conv2d_xor_layer(layer))
+    {
+        return NULL;
+    }
+    int output_channel = conv2d_rows(layer);
+    const qtype *weights = conv2d_xor_weights(layer);
+    int kernel_size = layer->kernel_size;
+    int taps = kernel_size * kernel_size;
+    int inputq_size = (layer->input_channel % SIZEQUANT) ? (layer->input_channel / SIZEQUANT + 1) : (layer->input_channel / SIZEQUANT);
+    int last = (kernel_size - 1) * layer->dilation;
+    int npix = output_height * output_width;
+
+    conv2d_border *border = (conv2d_border *)malloc(sizeof(conv2d_border));
+    if (border == NULL || (border->id = (int *)malloc(npix * sizeof(int))) == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for conv2d border table\n");
+        exit(1);
+    }
+    int nborder = 0;
+    for (int p = 0; p < npix; p++)
+    {
+        int base_y = (p / output_width) * layer->stride - layer->padding;
+        int base_x = (p % output_width) * layer->stride - layer->padding;
+        int interior = base_y >= 0 && base_x >= 0 && base_y + last < input_height && base_x + last < input_width;
+        border->id[p] = interior ? -1 : nborder++;
+    }
+    border->valid = (int *)malloc((nborder > 0 ? nborder : 1) * sizeof(int));
+    border->corr = (int *)calloc((size_t)(nborder > 0 ? nborder : 1) * output_channel, sizeof(int));
+    int *wpop = (int *)calloc((size_t)output_channel * taps, sizeof(int));
+    if (border->valid == NULL || border->corr == NULL || wpop == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for conv2d border table\n");
+        exit(1);
+    }
+    for (int t = 0; t < output_channel * taps; t++)
+    {
+        for (int kc = 0; kc < inputq_size; kc++)
+        {
+            wpop[t] += bitCount(weights[(size_t)t * inputq_size + kc]);
+        }
+    }
+    for (int p = 0; p < npix; p++)
+    {
+        int b = border->id[p];
+        if (b < 0)
+            continue;
+        int base_y = (p / output_width) * layer->stride - layer->padding;
+        int base_x = (p % output_width) * layer->stride - layer->padding;
+        border->valid[b] = taps;
+        for (int ky = 0; ky < kernel_size; ky++)
+        {
+            int iy = base_y + ky * layer->dilation;
+            for (int kx = 0; kx < kernel_size; kx++)
+            {
+                int ix = base_x + kx * layer->dilation;
+                if (iy < 0 || ix < 0 || iy >= input_height || ix >= input_width)
+                {
+                    border->valid[b] -= 1;
+                    for (int co = 0; co < output_channel; co++)
+                    {
+                        border->corr[(size_t)b * output_channel + co] += wpop[co * taps + ky * kernel_size + kx];
+                    }
+                }
+            }
+        }
+    }
+    free(wpop);
+    return border;
+}
+
+static void free_conv2d_border(conv2d_border *border)
+{
+    if (border == NULL)
+    {
+        return;
+    }
+    free(border->id);
+    free(border->valid);
+    free(border->corr);
+    free(border);
+}
+
+/**
+ * @brief Computes the signed results of np consecutive output pixels starting at p0, for
+ *        each of nimg images.
+ *
+ * With a direct kernel (see conv2d_forward_kernel) the block is computed straight from the
+ * padded input; nimg must then be 1. Otherwise the receptive fields of the block are
+ * gathered once into cols (each packed input word is read kernel_size^2 times in total
+ * instead of kernel_size^2 * output_channel times) and multiplied against all output
+ * channels with a single bgemm_* call, so the weights are streamed once for all nimg
+ * images. acc receives the results laid out (weight row, image, np); weight rows are the
+ * output channels, or the (digit plane, output channel) pairs of an MBIT layer.
+ *
+ * @param padded nimg inputs padded by layer->padding (see packed_pad); for MBIT layers,
+ *               the activation digit planes.
+ * @param border BNN border table (see conv2d_border_table), NULL for ternary layers.
+ */
+static void conv2d_gemm_block(const conv2d_layer *layer, conv2d_direct_fn kernel, packed_tensor **padded, int nimg,
+                              int output_width, const conv2d_border *border, int p0, int np, void *cols, int *acc)
+{
+    int input_width = padded[0]->width;
+    int input_channel = layer->input_channel;
+    int output_channel = conv2d_rows(layer);
+    int kernel_size = layer->kernel_size;
+    int stride = layer->stride;
+    int dilation = layer->dilation;
+    int inputq_size = padded[0]->words;
+    int taps = kernel_size * kernel_size;
+    int K = inputq_size * taps;
+    int n = nimg * np;
+
+    if (kernel != NULL)
+    {
+        kernel(layer, padded[0], output_width, p0, np, acc);
+    }
+    else
+    {
+        for (int i = 0; i < nimg; i++)
+        {
+            if (conv2d_xor_layer(layer))
+                bit_im2col_b(padded[i]->b, inputq_size, input_width, kernel_size, stride, dilation, output_width, p0, np,
+                             (qtype *)cols + (size_t)i * np * K);
+            else
+                bit_im2col_t(padded[i]->t, inputq_size, input_width, kernel_size, stride, dilation, output_width, p0, np,
+                             (tblock *)cols + (size_t)i * np * TBLOCKS(K));
+        }
+        switch (layer->quant)
+        {
+        case BNN:
+        case MBIT:
+            bgemm_bnn(output_channel, n, K, conv2d_xor_weights(layer), K, (qtype *)cols, K, acc, n);
+            break;
+        case TBN:
+            bgemm_tbn(output_channel, n, K, layer->weights_b, K, (tblock *)cols, TBLOCKS(K), acc, n);
+            break;
+        case TNN:
+            bgemm_tnn(output_channel, n, K, layer->weights_tp, TBLOCKS(K), (tblock *)cols, TBLOCKS(K), acc, n);
+            break;
+        default:
+            break;
+        }
+    }
+    if (!conv2d_xor_layer(layer))
+    {
+        return;
+    }
+
+    // BNN: turn mismatch counts into +1/-1 dot products, excluding padded taps
+    for (int j = 0; j < n; j++)
+    {
+        int b = border->id[p0 + j % np];
+        if (b < 0)
+        {
+            for (int co = 0; co < output_channel; co++)
+            {
+                acc[co * n + j] = taps * input_channel - 2 * acc[co * n + j];
+            }
+            continue;
+        }
+        const int *corr = border->corr + (size_t)b * output_channel;
+        for (int co = 0; co < output_channel; co++)
+        {
+            int cnt_minus_one = acc[co * n + j] - corr[co];
+            acc[co * n + j] = border->valid[b] * input_channel - 2 * cnt_minus_one;
+        }
+    }
+}
+
+static void *alloc_gemm_buffers(const conv2d_layer *layer, conv2d_direct_fn kernel, int inputq_size, int np, int **acc)
+{
+    int K = inputq_size * layer->kernel_size * layer->kernel_size;
+    // Direct kernels read the padded input and need no im2col buffer; ternary rows are planar
+    void *cols = NULL;
+    if (kernel == NULL && conv2d_xor_layer(layer))
+        cols = malloc((size_t)np * K * sizeof(qtype));
+    else if (kernel == NULL)
+        cols = aligned_alloc(sizeof(tblock), (size_t)np * TBLOCKS(K) * sizeof(tblock));
+    *acc = (int *)malloc((size_t)conv2d_rows(layer) * np * sizeof(int));
+    if ((cols == NULL && kernel == NULL) || *acc == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for im2col buffer\n");
+        exit(1);
+    }
+    return cols;
+}
+
+/**
+ * @brief Pads the N inputs of a batch (see packed_pad).
+ */
+static packed_tensor **packed_pad_batch(packed_tensor **inputs, int N, int padding)
+{
+    packed_tensor **padded = (packed_tensor **)malloc(N * sizeof(packed_tensor *));
+    if (padded == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for padded batch\n");
+        exit(1);
+    }
+    for (int n = 0; n < N; n++)
+    {
+        padded[n] = packed_pad(inputs[n], padding);
+    }
+    return padded;
+}
+
+static void free_packed_pad_batch(packed_tensor **padded, packed_tensor **inputs, int N)
+{
+    for (int n = 0; n < N; n++)
+    {
+        if (padded[n] != inputs[n])
+            free_packed_tensor(padded[n]);
+    }
+    free(padded);
+}
+
+typedef struct
+{
+    conv2d_layer *layer;
+    conv2d_direct_fn kernel;
+    packed_tensor **inputs, **padded;
+    const conv2d_border *border;
+    int N, group, chunk, nchunks;
+    int output_width, npix;
+    float *output;
+    packed_tensor *packed_out;
+    float out_thres;
+} gemm_job;
+
+/**
+ * @brief Runs the (image group, pixel chunk) items [begin, end) of conv2d_forward_gemm.
+ */
+static void gemm_items(void *arg, int begin, int end)
+{
+    const gemm_job *job = (const gemm_job *)arg;
+    conv2d_layer view;
+    const conv2d_layer *layer = conv2d_local(job->layer, &view);
+    int output_channel = layer->output_channel;
+    int N = job->N, group = job->group, chunk = job->chunk, nchunks = job->nchunks;
+    int npix = job->npix;
+    float *output = job->output;
+    packed_tensor *packed_out = job->packed_out;
+    for (int item = begin; item < end; item++)
+    {
+        int n0 = (item / nchunks) * group;
+        int nimg = (N - n0 < group) ? N - n0 : group;
+        int p0 = (item % nchunks) * chunk;
+        int np = (npix - p0 < chunk) ? npix - p0 : chunk;
+        int n = nimg * np;
+        int *acc;
+        void *cols = alloc_gemm_buffers(layer, job->kernel, job->inputs[0]->words, n, &acc);
+        conv2d_gemm_block(layer, job->kernel, job->padded + n0, nimg, job->output_width, job->border, p0, np, cols, acc);
+
+        for (int co = 0; co < output_channel; co++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                int value = acc[co * n + j];
+                int p = p0 + j % np;
+                if (packed_out != NULL && layer->out_thres != NULL)
+                    packed_store_channel(packed_out, p, co, value, layer->out_thres);
+                else if (packed_out != NULL)
+                    packed_store(packed_out, p, co, (float)value, job->out_thres);
+                else
+                    output[((size_t)(n0 + j / np) * output_channel + co) * npix + p] = (float)value;
+            }
+        }
+        free(cols);
+        free(acc);
+    }
+}
+
+/**
+ * @brief Quantized convolution of N images through bit-level im2col and the packed-bit GEMM.
+ *
+ * Work items are (image group, pixel chunk) pairs, split over the thread pool.
+ * Output pixels are processed in chunks of CONV_NCHUNK; images with fewer output pixels
+ * than that are grouped so one bgemm call covers about CONV_NCHUNK pixels of several images
+ * and the weights are loaded once per group. The epilogue either writes floats to output
+ * (image, channel, height, width) or, when packed_out is given (N = 1), quantizes each
+ * result with out_thres straight into the packed tensor.
+ */
+static void conv2d_forward_gemm(conv2d_layer *layer, packed_tensor **inputs, int N, int output_height, int output_width,
+                                float *output, packed_tensor *packed_out, float out_thres)
+{
+    int npix = output_height * output_width;
+    packed_tensor **padded = packed_pad_batch(inputs, N, layer->padding);
+    conv2d_border *border = conv2d_border_table(layer, inputs[0]->height, inputs[0]->width, output_height, output_width);
+    conv2d_direct_fn kernel = conv2d_forward_kernel(layer, output_height, output_width);
+    int group = (kernel == NULL && npix < CONV_NCHUNK) ? CONV_NCHUNK / npix : 1; // images per block
+    int chunk = (group > 1) ? npix : CONV_NCHUNK;
+    int nchunks = (npix + chunk - 1) / chunk;
+    int items = ((N + group - 1) / group) * nchunks;
+
+    gemm_job job = {layer, kernel, inputs, padded, border, N, group, chunk, nchunks, output_width, npix,
+                    output, packed_out, out_thres};
+    qcad_parallel_for(items, 1, gemm_items, &job);
+    free_conv2d_border(border);
+    free_packed_pad_batch(padded, inputs, N);
+}
+
+typedef struct
+{
+    conv2d_layer *layer;
+    conv2d_direct_fn kernel;
+    packed_tensor **inputs, **padded;
+    const conv2d_border *border;
+    int output_width, pool_size, pool_stride, pooled_height, pooled_width;
+    int band, nbands;
+    float *output;
+    packed_tensor *packed_out;
+    float out_thres;
+} pool_job;
+
+/**
+ * @brief Runs the (image, band) items [begin, end) of conv2d_pool_gemm.
+ */
+static void pool_bands(void *arg, int begin, int end)
+{
+    const pool_job *job = (const pool_job *)arg;
+    conv2d_layer view;
+    const conv2d_layer *layer = conv2d_local(job->layer, &view);
+    conv2d_direct_fn kernel = job->kernel;
+    packed_tensor **inputs = job->inputs, **padded = job->padded;
+    const conv2d_border *border = job->border;
+    int output_width = job->output_width, pool_size = job->pool_size, pool_stride = job->pool_stride;
+    int pooled_height = job->pooled_height, pooled_width = job->pooled_width;
+    int band = job->band, nbands = job->nbands;
+    float *output = job->output;
+    packed_tensor *packed_out = job->packed_out;
+    float out_thres = job->out_thres;
+    int output_channel = layer->output_channel;
+    int npooled = pooled_height * pooled_width;
+    const channel_thres *thres = layer->out_thres;
+    for (int item = begin; item < end; item++)
+    {
+        int img = item / nbands;
+        int py0 = (item % nbands) * band;
+        int rows = (pooled_height - py0 < band) ? pooled_height - py0 : band;
+        int y0 = py0 * pool_stride;
+        int conv_rows = (rows - 1) * pool_stride + pool_size;
+        int np = conv_rows * output_width;
+        int *acc;
+        void *cols = alloc_gemm_buffers(layer, kernel, inputs[0]->words, np, &acc);
+        conv2d_gemm_block(layer, kernel, padded + img, 1, output_width, border, y0 * output_width, np, cols, acc);
+        float *pooled = (output != NULL) ? output + (size_t)img * output_channel * npooled : NULL;
+
+        for (int co = 0; co < output_channel; co++)
+        {
+            const int *plane = acc + (size_t)co * np;
+            // Channels with a negative folded scale keep the window minimum instead
+            int sign = (packed_out != NULL && thres != NULL) ? thres->flip[co] : 1;
+            for (int i = 0; i < rows; i++)
+            {
+                for (int j = 0; j < pooled_width; j++)
+                {
+                    const int *window = plane + (i * pool_stride) * output_width + j * pool_stride;
+                    int max_value = sign * window[0];
+                    for (int m = 0; m < pool_size; m++)
+                    {
+                        for (int n = 0; n < pool_size; n++)
+                        {
+                            int value = sign * window[m * output_width + n];
+                            max_value = value > max_value ? value : max_value;
+                        }
+                    }
+                    size_t pixel = (size_t)(py0 + i) * pooled_width + j;
+                    if (packed_out != NULL && thres != NULL)
+                        packed_store_channel(packed_out, pixel, co, sign * max_value, thres);
+                    else if (packed_out != NULL)
+                        packed_store(packed_out, pixel, co, (float)max_value, out_thres);
+                    else
+                        pooled[(size_t)co * npooled + pixel] = (float)max_value;
+                }
+            }
+        }
+        free(cols);
+        free(acc);
+    }
+}
+
+/**
+ * @brief Quantized convolution fused with max pooling.
+ *
+ * The convolution is computed for bands of pooled output rows; each band's integer results
+ * stay in a small cache-resident buffer and are reduced over the pooling window before
+ * anything is written, so only the pooled tensor reaches memory. Bands of overlapping
+ * windows (pool_stride < pool_size) recompute the shared conv rows.
+ *
+ * For packed outputs the window maximum is quantized once. Thresholding is monotone, so
+ * this is the same as OR-ing the +1 bits (and AND-ing the -1 bits) of the window. With
+ * per-channel thresholds the flipped channels are monotone decreasing and take the minimum.
+ * Work items are (image, band) pairs of the N inputs; packed_out requires N = 1.
+ */
+static void conv2d_pool_gemm(conv2d_layer *layer, packed_tensor **inputs, int N, int output_width,
+                             int pool_size, int pool_stride, int pooled_height, int pooled_width,
+                             float *output, packed_tensor *packed_out, float out_thres)
+{
+    int band = CONV_NCHUNK / (pool_stride * output_width);
+    band = band > 0 ? band : 1;
+    int nbands = (pooled_height + band - 1) / band;
+    int output_height = (pooled_height - 1) * pool_stride + pool_size;
+    packed_tensor **padded = packed_pad_batch(inputs, N, layer->padding);
+    conv2d_border *border = conv2d_border_table(layer, inputs[0]->height, inputs[0]->width, output_height, output_width);
+    conv2d_direct_fn kernel = conv2d_forward_kernel(layer, output_height, output_width);
+
+    pool_job job = {layer, kernel, inputs, padded, border, output_width, pool_size, pool_stride, pooled_height,
+                    pooled_width, band, nbands, output, packed_out, out_thres};
+    qcad_parallel_for(N * nbands, 1, pool_bands, &job);
+    free_conv2d_border(border);
+    free_packed_pad_batch(padded, inputs, N);
+}
+
+/**
+ * @brief Float im2col: row (c, ky, kx) of cols (row stride ldc) holds the input samples of
+ *        that tap for the np output pixels from p0 on, zero where the tap falls into the padding.
+ */
+static void im2col_f(const float *input, int input_height, int input_width, const conv2d_layer *layer,
+                     int output_width, int p0, int np, float *cols, int ldc)
+{
+    int kernel_size = layer->kernel_size;
+    for (int c = 0; c < layer->input_channel; c++)
+    {
+        const float *plane = input + (size_t)c * input_height * input_width;
+        for (int ky = 0; ky < kernel_size; ky++)
+        {
+            for (int kx = 0; kx < kernel_size; kx++)
+            {
+                float *row = cols + ((size_t)(c * kernel_size + ky) * kernel_size + kx) * ldc;
+                for (int p = 0; p < np; p++)
+                {
+                    int iy = ((p0 + p) / output_width) * layer->stride - layer->padding + ky * layer->dilation;
+                    int ix = ((p0 + p) % output_width) * layer->stride - layer->padding + kx * layer->dilation;
+                    row[p] = (iy >= 0 && ix >= 0 && iy < input_height && ix < input_width) ? plane[iy * input_width + ix] : 0.0f;
+                }
+            }
+        }
+    }
+}
+
+typedef struct
+{
+    conv2d_layer *layer;
+    const float *inputs;
+    int N, input_height, input_width, output_width, npix;
+    int group, chunk, nchunks;
+    float *output;
+} sgemm_job;
+
+/**
+ * @brief Runs the (image group, pixel chunk) items [begin, end) of conv2d_forward_sgemm.
+ */
+static void sgemm_items(void *arg, int begin, int end)
+{
+    const sgemm_job *job = (const sgemm_job *)arg;
+    conv2d_layer view;
+    const conv2d_layer *layer = conv2d_local(job->layer, &view);
+    const float *inputs = job->inputs;
+    int N = job->N, input_height = job->input_height, input_width = job->input_width;
+    int output_width = job->output_width, npix = job->npix;
+    int group = job->group, chunk = job->chunk, nchunks = job->nchunks;
+    float *output = job->output;
+    int output_channel = layer->output_channel;
+    size_t input_size = (size_t)layer->input_channel * input_height * input_width;
+    int K = layer->input_channel * layer->kernel_size * layer->kernel_size;
+    for (int item = begin; item < end; item++)
+    {
+        int n0 = (item / nchunks) * group;
+        int nimg = (N - n0 < group) ? N - n0 : group;
+        int p0 = (item % nchunks) * chunk;
+        int np = (npix - p0 < chunk) ? npix - p0 : chunk;
+        int n = nimg * np;
+        float *cols = (float *)malloc((size_t)K * n * sizeof(float));
+        float *out = (nimg > 1) ? (float *)malloc((size_t)output_channel * n * sizeof(float)) : NULL;
+        if (cols == NULL || (nimg > 1 && out == NULL))
+        {
+            fprintf(stderr, "Memory allocation failed for im2col buffer\n");
+            exit(1);
+        }
+        for (int i = 0; i < nimg; i++)
+        {
+            im2col_f(inputs + (n0 + i) * input_size, input_height, input_width, layer, output_width, p0, np, cols + (size_t)i * np, n);
+        }
+        if (nimg == 1)
+        {
+            sgemm(output_channel, np, K, layer->weights_f, K, cols, np, output + (size_t)n0 * output_channel * npix + p0, npix);
+        }
+        else
+        {
+            sgemm(output_channel, n, K, layer->weights_f, K, cols, n, out, n);
+            for (int i = 0; i < nimg; i++)
+            {
+                for (int co = 0; co < output_channel; co++)
+                {
+                    memcpy(output + ((size_t)(n0 + i) * output_channel + co) * npix, out + (size_t)co * n + (size_t)i * np,
+                           npix * sizeof(float));
+                }
+            }
+        }
+        free(cols);
+        free(out);
+    }
+}
+
+/**
+ * @brief FP convolution of N images as im2col + SGEMM.
+ *
+ * The weights (output channel, input channel * kernel_size^2) multiply im2col chunks of
+ * CONV_FP_NCHUNK output pixels, written straight into the (image, channel, height, width)
+ * output. Like conv2d_forward_gemm, small images are grouped so one sgemm call covers several
+ * of them; their results go through a scratch buffer. Work items are independent and split
+ * over the thread pool.
+ */
+static void conv2d_forward_sgemm(conv2d_layer *layer, const float *inputs, int N, int input_height, int input_width,
+                                 int output_height, int output_width, float *output)
+{
+    int npix = output_height * output_width;
+    int group = (npix < CONV_FP_NCHUNK) ? CONV_FP_NCHUNK / npix : 1; // images per block
+    int chunk = (group > 1) ? npix : CONV_FP_NCHUNK;
+    int nchunks = (npix + chunk - 1) / chunk;
+    int items = ((N + group - 1) / group) * nchunks;
+    sgemm_job job = {layer, inputs, N, input_height, input_width, output_width, npix, group, chunk, nchunks, output};
+    qcad_parallel_for(items, 1, sgemm_items, &job);
+}
+
+/**
+ * @brief INT8 im2col: row p of cols (row stride ldc) holds the quantized receptive field,
+ *        ordered (c, ky, kx) like weights_f, of output pixel p0 + p. Padded taps take the
+ *        zero point, the row tail up to ldc is zero.
+ */
+static void im2col_u8(const uint8_t *input, int input_height, int input_width, const conv2d_layer *layer,
+                      int output_width, int p0, int np, uint8_t *cols, int ldc)
+{
+    int kernel_size = layer->kernel_size;
+    int K = layer->input_channel * kernel_size * kernel_size;
+    for (int p = 0; p < np; p++)
+    {
+        int base_y = ((p0 + p) / output_width) * layer->stride - layer->padding;
+        int base_x = ((p0 + p) % output_width) * layer->stride - layer->padding;
+        uint8_t *row = cols + (size_t)p * ldc;
+        int last = (kernel_size - 1) * layer->dilation;
+        if (layer->dilation == 1 && base_y >= 0 && base_x >= 0 && base_y + last < input_height && base_x + last < input_width)
+        {
+            // Interior pixel: every kernel row is a contiguous run of the input row
+            for (int c = 0; c < layer->input_channel; c++)
+            {
+                const uint8_t *src = input + ((size_t)c * input_height + base_y) * input_width + base_x;
+                for (int ky = 0; ky < kernel_size; ky++)
+                {
+                    memcpy(row, src + ky * input_width, kernel_size);
+                    row += kernel_size;
+                }
+            }
+            memset(row, 0, ldc - K);
+            continue;
+        }
+        for (int c = 0; c < layer->input_channel; c++)
+        {
+            const uint8_t *plane = input + (size_t)c * input_height * input_width;
+            for (int ky = 0; ky < kernel_size; ky++)
+            {
+                int iy = base_y + ky * layer->dilation;
+                for (int kx = 0; kx < kernel_size; kx++)
+                {
+                    int ix = base_x + kx * layer->dilation;
+                    *row++ = (iy >= 0 && ix >= 0 && iy < input_height && ix < input_width) ? plane[iy * input_width + ix] : IGEMM_ZERO;
+                }
+            }
+        }
+        memset(row, 0, ldc - K);
+    }
+}
+
+typedef struct
+{
+    conv2d_layer *layer;
+    const uint8_t *quant;
+    const float *scale;
+    int N, input_height, input_width, output_width, npix;
+    int group, chunk, nchunks;
+    float *output;
+    uint8_t *output_q;   // requantized output instead of output when not NULL
+    float inv_out_scale; // reciprocal of the scale of output_q
+} int8_job;
+
+/**
+ * @brief Runs the (image group, pixel chunk) items [begin, end) of conv2d_forward_int8.
+ */
+static void int8_items(void *arg, int begin, int end)
+{
+    const int8_job *job = (const int8_job *)arg;
+    conv2d_layer view;
+    const conv2d_layer *layer = conv2d_local(job->layer, &view);
+    const uint8_t *quant = job->quant;
+    const float *scale = job->scale;
+    int N = job->N, input_height = job->input_height, input_width = job->input_width;
+    int output_width = job->output_width, npix = job->npix;
+    int group = job->group, chunk = job->chunk, nchunks = job->nchunks;
+    float *output = job->output;
+    uint8_t *output_q = job->output_q;
+    int output_channel = layer->output_channel;
+    size_t input_size = (size_t)layer->input_channel * input_height * input_width;
+    int ldc = IGEMM_STRIDE(layer->input_channel * layer->kernel_size * layer->kernel_size);
+    for (int item = begin; item < end; item++)
+    {
+        int n0 = (item / nchunks) * group;
+        int nimg = (N - n0 < group) ? N - n0 : group;
+        int p0 = (item % nchunks) * chunk;
+        int np = (npix - p0 < chunk) ? npix - p0 : chunk;
+        int n = nimg * np;
+        uint8_t *cols = (uint8_t *)malloc((size_t)n * ldc);
+        int *acc = (int *)malloc((size_t)output_channel * n * sizeof(int));
+        if (cols == NULL || acc == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for im2col buffer\n");
+            exit(1);
+        }
+        for (int i = 0; i < nimg; i++)
+        {
+            im2col_u8(quant + (n0 + i) * input_size, input_height, input_width, layer, output_width, p0, np,
+                      cols + (size_t)i * np * ldc, ldc);
+        }
+        igemm_u8s8(output_channel, n, ldc, layer->weights_q, ldc, cols, ldc, acc, n);
+        for (int co = 0; co < output_channel; co++)
+        {
+            int zero = IGEMM_ZERO * layer->weight_sum[co];
+            for (int i = 0; i < nimg; i++)
+            {
+                const int *src = acc + (size_t)co * n + (size_t)i * np;
+                size_t offset = ((size_t)(n0 + i) * output_channel + co) * npix + p0;
+                float requant = scale[n0 + i] * layer->weight_scale[co];
+                if (output_q != NULL)
+                {
+                    // Straight to the next layer's 7-bit input: one multiply by the scale ratio
+                    float ratio = requant * job->inv_out_scale;
+                    for (int p = 0; p < np; p++)
+                    {
+                        output_q[offset + p] = igemm_quant((float)(src[p] - zero), ratio);
+                    }
+                    continue;
+                }
+                for (int p = 0; p < np; p++)
+                {
+                    output[offset + p] = (float)(src[p] - zero) * requant;
+                }
+            }
+        }
+        free(cols);
+        free(acc);
+    }
+}
+
+/**
+ * @brief INT8 convolution of N quantized images (quant, N * input size bytes, with their
+ *        scales) as im2col + igemm_u8s8.
+ *
+ * Work items follow conv2d_forward_gemm: CONV_NCHUNK output pixels, with small images
+ * grouped so one GEMM covers several of them. The epilogue removes the activation zero point
+ * and requantizes the int32 results with the image and per-channel weight scales into the
+ * (image, channel, height, width) output, or, when output_q is not NULL, into 7-bit values
+ * of scale out_scale (see igemm_quant).
+ */
+static void conv2d_gemm_int8(conv2d_layer *layer, const uint8_t *quant, const float *scale, int N, int input_height,
+                             int input_width, int output_height, int output_width, float *output, uint8_t *output_q,
+                             float out_scale)
+{
+    int npix = output_height * output_width;
+    int group = (npix < CONV_NCHUNK) ? CONV_NCHUNK / npix : 1; // images per block
+    int chunk = (group > 1) ? npix : CONV_NCHUNK;
+    int nchunks = (npix + chunk - 1) / chunk;
+    int items = ((N + group - 1) / group) * nchunks;
+    int8_job job = {layer, quant, scale, N, input_height, input_width, output_width, npix, group, chunk, nchunks,
+                    output, output_q, (output_q != NULL) ? 1.0f / out_scale : 0.0f};
+    qcad_parallel_for(items, 1, int8_items, &job);
+}
+
+/**
+ * @brief INT8 convolution of N float images, each quantized with its own scale (see
+ *        igemm_input_scale).
+ */
+static void conv2d_forward_int8(conv2d_layer *layer, const float *inputs, int N, int input_height, int input_width,
+                                int output_height, int output_width, float *output)
+{
+    size_t input_size = (size_t)layer->input_channel * input_height * input_width;
+    uint8_t *quant = (uint8_t *)malloc(N * input_size);
+    float *scale = (float *)malloc(N * sizeof(float));
+    if (quant == NULL || scale == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for INT8 input\n");
+        exit(1);
+    }
+    for (int n = 0; n < N; n++)
+    {
+        scale[n] = igemm_input_scale(inputs + n * input_size, input_size, layer->input_thres);
+        float inv_scale = 1.0f / scale[n];
+        for (size_t i = 0; i < input_size; i++)
+        {
+            quant[n * input_size + i] = igemm_quant(inputs[n * input_size + i], inv_scale);
+        }
+    }
+    conv2d_gemm_int8(layer, quant, scale, N, input_height, input_width, output_height, output_width, output, NULL, 0.0f);
+    free(quant);
+    free(scale);
+}
+
+/**
+ * @brief Quantizes each image of an (N, channel, height, width) batch into a packed tensor.
+ */
+static packed_tensor **pack_batch(const conv2d_layer *layer, const float *inputs, int N, int input_height, int input_width)
+{
+    size_t input_size = (size_t)layer->input_channel * input_height * input_width;
+    packed_tensor **packed = (packed_tensor **)malloc(N * sizeof(packed_tensor *));
+    if (packed == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for packed batch\n");
+        exit(1);
+    }
+    for (int n = 0; n < N; n++)
+    {
+        packed[n] = pack_tensor(inputs + n * input_size, layer->input_channel, input_height, input_width, layer->quant,
+                                layer->input_thres);
+    }
+    return packed;
+}
+
+static void free_packed_batch(packed_tensor **packed, int N)
+{
+    for (int n = 0; n < N; n++)
+    {
+        free_packed_tensor(packed[n]);
+    }
+    free(packed);
+}
+
+typedef struct
+{
+    conv2d_layer *layer;
+    packed_tensor **padded;
+    const conv2d_border *border;
+    const float *scale;
+    int output_width, npix, nchunks;
+    float *output;
+} bitserial_job;
+
+/**
+ * @brief Runs the (image, pixel chunk) items [begin, end) of conv2d_forward_bitserial.
+ */
+static void bitserial_items(void *arg, int begin, int end)
+{
+    const bitserial_job *job = (const bitserial_job *)arg;
+    conv2d_layer view;
+    const conv2d_layer *layer = conv2d_local(job->layer, &view);
+    packed_tensor **padded = job->padded;
+    const conv2d_border *border = job->border;
+    const float *scale = job->scale;
+    int output_width = job->output_width, npix = job->npix, nchunks = job->nchunks;
+    float *output = job->output;
+    int output_channel = layer->output_channel;
+    int abits = layer->act_bits;
+    int wbits = layer->weight_bits;
+    for (int item = begin; item < end; item++)
+    {
+        int img = item / nchunks;
+        int p0 = (item % nchunks) * CONV_NCHUNK;
+        int np = (npix - p0 < CONV_NCHUNK) ? npix - p0 : CONV_NCHUNK;
+        int n = abits * np;
+        int *acc;
+        void *cols = alloc_gemm_buffers(layer, NULL, padded[0]->words, n, &acc);
+        conv2d_gemm_block(layer, NULL, padded + (size_t)img * abits, abits, output_width, border, p0, np, cols, acc);
+
+        for (int co = 0; co < output_channel; co++)
+        {
+            float *dst = output + ((size_t)img * output_channel + co) * npix + p0;
+            float rescale = scale[img] * layer->plane_scale[co];
+            for (int p = 0; p < np; p++)
+            {
+                int64_t sum = 0;
+                for (int j = 0; j < wbits; j++)
+                {
+                    const int *row = acc + ((size_t)j * output_channel + co) * n;
+                    for (int i = 0; i < abits; i++)
+                    {
+                        sum += (int64_t)row[i * np + p] * ((int64_t)1 << (i + j));
+                    }
+                }
+                dst[p] = (float)sum * rescale;
+            }
+        }
+        free(cols);
+        free(acc);
+    }
+}
+
+/**
+ * @brief Bit-serial (MBIT) convolution of N images.
+ *
+ * Each image is quantized into act_bits digit planes with its own scale. A work item runs
+ * one pixel chunk of one image: the act_bits planes go through conv2d_gemm_block as if they
+ * were images, so a single bgemm_bnn call computes every (weight plane, activation plane)
+ * BNN dot product, padding included. The epilogue sums them with weights 2^(i + j) and
+ * rescales the levels with the image and per-channel weight scales.
+ */
+static void conv2d_forward_bitserial(conv2d_layer *layer, const float *inputs, int N, int input_height, int input_width,
+                                     int output_height, int output_width, float *output)
+{
+    int npix = output_height * output_width;
+    int abits = layer->act_bits;
+    size_t input_size = (size_t)layer->input_channel * input_height * input_width;
+    packed_tensor **planes = (packed_tensor **)malloc((size_t)N * abits * sizeof(packed_tensor *));
+    float *scale = (float *)malloc(N * sizeof(float));
+    if (planes == NULL || scale == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for activation planes\n");
         exit(1);
     }
-    return layer;
+    for (int n = 0; n < N; n++)
+    {
+        scale[n] = bitserial_scale(inputs + n * input_size, input_size, layer->input_thres, abits);
+        pack_tensor_planes(inputs + n * input_size, layer->input_channel, input_height, input_width, abits, scale[n],
+                           planes + (size_t)n * abits);
+    }
+    packed_tensor **padded = packed_pad_batch(planes, N * abits, layer->padding);
+    conv2d_border *border = conv2d_border_table(layer, input_height, input_width, output_height, output_width);
+    int nchunks = (npix + CONV_NCHUNK - 1) / CONV_NCHUNK;
+
+    bitserial_job job = {layer, padded, border, scale, output_width, npix, nchunks, output};
+    qcad_parallel_for(N * nchunks, 1, bitserial_items, &job);
+    free_conv2d_border(border);
+    free_packed_pad_batch(padded, planes, N * abits);
+    free_packed_batch(planes, N * abits);
+    free(scale);
 }
 
 /**
@@ -128,13 +1699,33 @@ conv2d_layer *create_conv2d_layer(int input_channel, int output_channel, int ker
  * the input data appropriately and then performing the forward pass computation.
  *
  * @param layer Pointer to the conv_layer structure containing the layer parameters.
- * @param input Pointer to the input data array.
+ * @param input Pointer to the input data array, laid out (channel, height, width).
  * @param input_height The height of the input data.
  * @param input_width The width of the input data.
  *
- * @return A pointer to the output data array.
+ * @return A pointer to the output data array, laid out (output channel, output height, output width).
  */
 float *conv2d_forward(conv2d_layer *layer, float *input, int input_height, int input_width)
+{
+    return conv2d_forward_batch(layer, input, 1, input_height, input_width);
+}
+
+/**
+ * @brief Forward pass of a convolutional layer on a batch of N images.
+ *
+ * Same as conv2d_forward on every image, but the images share the work items of one pass:
+ * small images are grouped into one GEMM so the weights are loaded once per group, and the
+ * (image, pixel chunk) items are split over the thread pool.
+ *
+ * @param layer Pointer to the conv2d_layer structure.
+ * @param inputs Input batch laid out (N, channel, height, width). It is freed.
+ * @param N Number of images.
+ * @param input_height The height of each image.
+ * @param input_width The width of each image.
+ *
+ * @return The output batch, laid out (N, output channel, output height, output width).
+ */
+float *conv2d_forward_batch(conv2d_layer *layer, float *inputs, int N, int input_height, int input_width)
 {
     int input_channel = layer->input_channel;
     int output_channel = layer->output_channel;
@@ -142,328 +1733,331 @@ float *conv2d_forward(conv2d_layer *layer, float *input, int input_height, int i
     int stride = layer->stride;
     int padding = layer->padding;
     int dilation = layer->dilation;
-    float input_thres = layer->input_thres;
     quant_type quant = layer->quant;
 
-    int inputq_size = (input_channel % SIZEQUANT) ? (input_channel / SIZEQUANT + 1) : (input_channel / SIZEQUANT);
     int output_height = (int)((input_height + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1; // height
     int output_width = (int)((input_width + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;   // width
-    float *output = (float*)malloc(output_channel * output_height * output_width * sizeof(float*));
-    int dim1_input = inputq_size;
-    int dim2_input = input_height; // height
-    int dim3_input = input_width;  // width
-    conv2d_input input_quant[dim1_input*dim2_input*dim3_input];
-    
+    size_t output_size = (size_t)output_channel * output_height * output_width;
+    float *output = (float *)malloc(N * output_size * sizeof(float));
+    if (output == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for conv2d output\n");
+        exit(1);
+    }
+
     switch (quant)
     {
     case BNN:
-        for (int c = 0; c < input_channel; c++)
-        {
-            for (int h = 0; h < dim2_input; h++)
-            {
-                for (int w = 0; w < dim3_input; w++)
-                {
-                    if (input[c*h*w] < input_thres)
-                    {
-                        input_quant[(c / SIZEQUANT) * h * w].b |= 1 << (c % SIZEQUANT);
-                    }
-                }
-            }
-        }
-        break;
     case TBN:
     case TNN:
-        for (int c = 0; c < input_channel; c++)
+    {
+        packed_tensor **input_quant = pack_batch(layer, inputs, N, input_height, input_width);
+        conv2d_forward_gemm(layer, input_quant, N, output_height, output_width, output, NULL, 0.0f);
+        free_packed_batch(input_quant, N);
+        break;
+    }
+    case FP:
+        if (layer->weights_wino != NULL && input_channel >= WINO_MIN_CHANNELS &&
+            ((output_height + 1) / 2) * ((output_width + 1) / 2) >= WINO_MIN_TILES)
         {
-            for (int h = 0; h < dim2_input; h++)
+            size_t input_size = (size_t)input_channel * input_height * input_width;
+            for (int n = 0; n < N; n++)
             {
-                for (int w = 0; w < dim3_input; w++)
-                {
-                    if (input[c*h*w] >= input_thres)
-                    {
-                        input_quant[(c / SIZEQUANT)*h*w].t.bit_1 |= 1 << (c % SIZEQUANT);
-                    }
-                    else if (input[c*h*w]  <= -input_thres)
-                    {
-                        input_quant[(c / SIZEQUANT)*h*w].t.bit_0 |= 1 << (c % SIZEQUANT);
-                    }
-                }
+                conv2d_forward_winograd(layer, inputs + n * input_size, input_height, input_width, output_height, output_width,
+                                        output + n * output_size);
             }
         }
+        else
+            conv2d_forward_sgemm(layer, inputs, N, input_height, input_width, output_height, output_width, output);
         break;
-    case FP:
+    case INT8:
+        conv2d_forward_int8(layer, inputs, N, input_height, input_width, output_height, output_width, output);
+        break;
+    case MBIT:
+        conv2d_forward_bitserial(layer, inputs, N, input_height, input_width, output_height, output_width, output);
         break;
-
     default:
         fprintf(stderr, "conv_forward: Unknown quantization type\n");
         exit(1);
     }
-
-
     
-    switch (quant)
-    {
-    case BNN:
-#ifdef MC
-    #pragma omp parallel for collapse(3)
-#endif
-        for (int co = 0; co < output_channel; co++)
-        {
-            for (int y = 0; y < output_height; y++)
-            {
-                for (int x = 0; x < output_width; x++)
-                {
-                    int cnt_minus_one = 0;
-                    int cnt_zero = 0;
+    free(inputs);
+    return output;
+}
 
-                    // Tiền tính toán chỉ số cho x và y để tránh tính toán lại
-                    int base_x = x * stride - padding;
-                    int base_y = y * stride - padding;
+/**
+ * @brief Forward pass of a quantized convolutional layer on a packed input, with a packed output.
+ *
+ * The layer's results are never materialized as floats: the epilogue applies the next layer's
+ * quantization (next_quant, next_thres) and sets the output bits directly, so chained
+ * quantized layers only exchange packed tensors.
+ *
+ * @param layer Pointer to a BNN, TBN or TNN conv2d_layer.
+ * @param input Packed input, encoded for this layer's quantization type. It is freed.
+ * @param next_quant Quantization type of the layer that consumes the output.
+ * @param next_thres Input threshold of the layer that consumes the output. Ignored when the
+ *                   layer has per-channel thresholds (layer->out_thres).
+ *
+ * @return The packed output tensor.
+ */
+packed_tensor *conv2d_forward_packed(conv2d_layer *layer, packed_tensor *input, quant_type next_quant, float next_thres)
+{
+    if (layer->quant != BNN && layer->quant != TBN && layer->quant != TNN)
+    {
+        fprintf(stderr, "conv2d_forward_packed: layer is not quantized\n");
+        exit(1);
+    }
+    if (input->channel != layer->input_channel || (input->quant == BNN) != (layer->quant == BNN))
+    {
+        fprintf(stderr, "conv2d_forward_packed: input does not match the layer\n");
+        exit(1);
+    }
+    int kernel_size = layer->kernel_size;
+    int stride = layer->stride;
+    int padding = layer->padding;
+    int dilation = layer->dilation;
+    int output_height = (int)((input->height + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;
+    int output_width = (int)((input->width + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;
 
-                    for (int kc = 0; kc < inputq_size; kc++)
-                    {
-                        for (int ky = 0; ky < kernel_size; ky++)
-                        {
-                            int padded_y = base_y + ky * dilation; // Tiền tính padded_y
-
-                            for (int kx = 0; kx < kernel_size; kx++)
-                            {
-                                int padded_x = base_x + kx * dilation; // Tiền tính padded_x
-
-                                // Kiểm tra điều kiện biên
-                                if (padded_x < 0 || padded_y < 0 || padded_x >= input_width || padded_y >= input_height)
-                                {
-                                    cnt_zero += 1;
-                                }
-                                else
-                                {
-                                    // Truy xuất giá trị từ mảng và lưu vào biến tạm
-                                    qtype input_b = input_quant[kc*padded_y*padded_x].b;
-                                    qtype weight_b = layer->weights_b[co*kc*ky*kx];
-
-                                    // Tính toán kết quả bit XOR
-                                    qtype result_bit = input_b ^ weight_b;
-
-                                    // Đếm số bit khác nhau (bitCount)
-                                    cnt_minus_one += bitCount(result_bit);
-                                }
-                            }
-                        }
-                    }
+    packed_tensor *output = create_packed_tensor(next_quant, layer->output_channel, output_height, output_width);
+    conv2d_forward_gemm(layer, &input, 1, output_height, output_width, NULL, output, next_thres);
+    free_packed_tensor(input);
+    return output;
+}
 
-                    // Tính số bit `1` còn lại từ tổng số bit trong kernel
-                    int cnt_one = (kernel_size * kernel_size - cnt_zero) * inputq_size - cnt_minus_one;
+/**
+ * @brief Forward pass of an INT8 convolutional layer on an INT8 input, with an INT8 output.
+ *
+ * The input is used as it is, without the float round trip, so chained INT8 layers only
+ * exchange int8_tensors. With next_thres > 0, the epilogue requantizes the int32 results
+ * directly to the next layer's input scale (see igemm_input_scale); otherwise the float
+ * results are computed first and quantized with their own range.
+ *
+ * @param layer Pointer to an INT8 conv2d_layer.
+ * @param input INT8 input, e.g. from quantize_int8_tensor. It is freed.
+ * @param next_thres Input clipping range of the layer that consumes the output, 0 for a
+ *                   per-output range.
+ *
+ * @return The INT8 output tensor.
+ */
+int8_tensor *conv2d_forward_int8_tensor(conv2d_layer *layer, int8_tensor *input, float next_thres)
+{
+    if (layer->quant != INT8)
+    {
+        fprintf(stderr, "conv2d_forward_int8_tensor: layer is not an INT8 layer\n");
+        exit(1);
+    }
+    if (input->channel != layer->input_channel || input->zero != IGEMM_ZERO)
+    {
+        fprintf(stderr, "conv2d_forward_int8_tensor: input does not match the layer\n");
+        exit(1);
+    }
+    int kernel_size = layer->kernel_size;
+    int stride = layer->stride;
+    int padding = layer->padding;
+    int dilation = layer->dilation;
+    int output_height = (int)((input->height + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;
+    int output_width = (int)((input->width + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;
 
-                    // Cập nhật kết quả đầu ra
-                    output[co*y*x] = (float)(cnt_one - cnt_minus_one);
-                }
-            }
+    int8_tensor *output;
+    if (next_thres > 0.0f)
+    {
+        output = create_int8_tensor(layer->output_channel, output_height, output_width, igemm_input_scale(NULL, 0, next_thres));
+        conv2d_gemm_int8(layer, input->q, &input->scale, 1, input->height, input->width, output_height, output_width, NULL,
+                         output->q, output->scale);
+    }
+    else
+    {
+        float *values = (float *)malloc((size_t)layer->output_channel * output_height * output_width * sizeof(float));
+        if (values == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for INT8 output\n");
+            exit(1);
         }
+        conv2d_gemm_int8(layer, input->q, &input->scale, 1, input->height, input->width, output_height, output_width, values,
+                         NULL, 0.0f);
+        output = quantize_int8_tensor(values, layer->output_channel, output_height, output_width, 0.0f);
+        free(values);
+    }
+    free_int8_tensor(input);
+    return output;
+}
 
-        break;
-    case TBN:
-#ifdef MC
-    #pragma omp parallel for collapse(3)
-#endif
-        for (int co = 0; co < output_channel; co++)
-        {
-            for (int y = 0; y < output_height; y++)
-            {
-                for (int x = 0; x < output_width; x++)
-                {
-                    int cnt_minus_one = 0;
-                    int cnt_one = 0;
-                    int cnt_zero = 0;
+/**
+ * @brief Convolution followed by max pooling, fused for quantized layers.
+ *
+ * Equivalent to max_pooling_2d_k(conv2d_forward(...), pool_size, pool_stride) but the
+ * full-resolution conv output is never written: the integer results are reduced over each
+ * pooling window before the pooled tensor is stored. FP, INT8 and MBIT layers fall back
+ * to the unfused pair.
+ *
+ * @param layer Pointer to the conv2d_layer structure.
+ * @param input Pointer to the input data array, laid out (channel, height, width). It is freed.
+ * @param input_height The height of the input data.
+ * @param input_width The width of the input data.
+ * @param pool_size The size of the pooling window.
+ * @param pool_stride The stride of the pooling window.
+ *
+ * @return The pooled output, laid out (output channel, pooled height, pooled width).
+ */
+float *conv2d_pool_forward(conv2d_layer *layer, float *input, int input_height, int input_width, int pool_size, int pool_stride)
+{
+    return conv2d_pool_forward_batch(layer, input, 1, input_height, input_width, pool_size, pool_stride);
+}
 
-                    // Tiền tính chỉ số cho x và y để tránh tính toán lại
-                    int base_x = x * stride - padding;
-                    int base_y = y * stride - padding;
+/**
+ * @brief conv2d_pool_forward on a batch of N images laid out (N, channel, height, width).
+ *
+ * The input is freed. Returns the pooled batch, laid out (N, output channel, pooled height,
+ * pooled width).
+ */
+float *conv2d_pool_forward_batch(conv2d_layer *layer, float *inputs, int N, int input_height, int input_width,
+                                 int pool_size, int pool_stride)
+{
+    int kernel_size = layer->kernel_size;
+    int stride = layer->stride;
+    int padding = layer->padding;
+    int dilation = layer->dilation;
+    int output_height = (int)((input_height + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;
+    int output_width = (int)((input_width + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;
 
-                    for (int kc = 0; kc < inputq_size; kc++)
-                    {
-                        for (int ky = 0; ky < kernel_size; ky++)
-                        {
-                            int padded_y = base_y + ky * dilation; // Tiền tính padded_y
-
-                            for (int kx = 0; kx < kernel_size; kx++)
-                            {
-                                int padded_x = base_x + kx * dilation; // Tiền tính padded_x
-
-                                // Kiểm tra điều kiện biên ngoài vòng lặp sâu nhất
-                                if (padded_x < 0 || padded_y < 0 || padded_x >= input_width || padded_y >= input_height)
-                                {
-                                    cnt_zero += 1;
-                                }
-                                else
-                                {
-                                    // Truy xuất các giá trị từ mảng chỉ một lần và lưu vào biến tạm
-                                    int weight = layer->weights_b[co*kc*ky*kx];
-                                    int i_weight = ~weight;
-
-                                    qtype bit_1 = input_quant[kc*padded_y*padded_x].t.bit_1;
-                                    qtype bit_0 = input_quant[kc*padded_y*padded_x].t.bit_0;
-
-                                    // Tính toán kết quả từ các bit
-                                    qtype result_bit0 = (bit_1 & i_weight) | (bit_0 & weight);
-                                    qtype result_bit1 = (bit_1 & weight) | (bit_0 & i_weight);
-
-                                    // Sử dụng hàm đếm bit đã tối ưu
-                                    cnt_minus_one += bitCount(result_bit0);
-                                    cnt_one += bitCount(result_bit1);
-                                }
-                            }
-                        }
-                    }
+    if (layer->quant != BNN && layer->quant != TBN && layer->quant != TNN)
+    {
+        float *output = conv2d_forward_batch(layer, inputs, N, input_height, input_width);
+        return max_pooling_2d_k_batch(output, N, layer->output_channel, output_height, output_width, pool_size, pool_stride);
+    }
 
-                    // Cập nhật kết quả đầu ra
-                    output[co*y*x] = (float)(cnt_one - cnt_minus_one);
-                }
-            }
-        }
+    int pooled_height = (output_height - pool_size) / pool_stride + 1;
+    int pooled_width = (output_width - pool_size) / pool_stride + 1;
+    float *output = (float *)malloc((size_t)N * layer->output_channel * pooled_height * pooled_width * sizeof(float));
+    if (output == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for pooled output\n");
+        exit(1);
+    }
+    packed_tensor **input_quant = pack_batch(layer, inputs, N, input_height, input_width);
+    conv2d_pool_gemm(layer, input_quant, N, output_width, pool_size, pool_stride, pooled_height, pooled_width, output, NULL, 0.0f);
+    free_packed_batch(input_quant, N);
+    free(inputs);
+    return output;
+}
 
-        break;
+/**
+ * @brief Packed-in, packed-out convolution fused with max pooling.
+ *
+ * See conv2d_forward_packed and conv2d_pool_forward. The input is freed.
+ */
+packed_tensor *conv2d_pool_forward_packed(conv2d_layer *layer, packed_tensor *input, int pool_size, int pool_stride,
+                                          quant_type next_quant, float next_thres)
+{
+    if (layer->quant != BNN && layer->quant != TBN && layer->quant != TNN)
+    {
+        fprintf(stderr, "conv2d_pool_forward_packed: layer is not quantized\n");
+        exit(1);
+    }
+    if (input->channel != layer->input_channel || (input->quant == BNN) != (layer->quant == BNN))
+    {
+        fprintf(stderr, "conv2d_pool_forward_packed: input does not match the layer\n");
+        exit(1);
+    }
+    int kernel_size = layer->kernel_size;
+    int stride = layer->stride;
+    int padding = layer->padding;
+    int dilation = layer->dilation;
+    int output_height = (int)((input->height + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;
+    int output_width = (int)((input->width + 2 * padding - dilation * (kernel_size - 1) - 1) / stride) + 1;
+    int pooled_height = (output_height - pool_size) / pool_stride + 1;
+    int pooled_width = (output_width - pool_size) / pool_stride + 1;
 
-    case TNN:
-#ifdef MC
-    #pragma omp parallel for collapse(3)
-#endif
+    packed_tensor *output = create_packed_tensor(next_quant, layer->output_channel, pooled_height, pooled_width);
+    conv2d_pool_gemm(layer, &input, 1, output_width, pool_size, pool_stride, pooled_height, pooled_width, NULL, output, next_thres);
+    free_packed_tensor(input);
+    return output;
+}
 
-        for (int co = 0; co < output_channel; co++)
-        {
-            for (int y = 0; y < output_height; y++)
-            {
-                for (int x = 0; x < output_width; x++)
-                {
-                    int cnt_minus_one = 0;
-                    int cnt_one = 0;
-                    int cnt_zero = 0;
+/**
+ * @brief One output row of a 2x2, stride 2 max pooling from two adjacent input rows.
+ */
+void max_pool_2x2_row_scalar(const float *row0, const float *row1, float *output, int output_width)
+{
+    for (int j = 0; j < output_width; j++)
+    {
+        float a = row0[2 * j] > row0[2 * j + 1] ? row0[2 * j] : row0[2 * j + 1];
+        float b = row1[2 * j] > row1[2 * j + 1] ? row1[2 * j] : row1[2 * j + 1];
+        output[j] = a > b ? a : b;
+    }
+}
 
-                    // Tiền tính toán chỉ số cho x và y để tránh tính toán lại
-                    int base_x = x * stride - padding;
-                    int base_y = y * stride - padding;
+#ifdef QCAD_X86
+__attribute__((target("avx2"))) void max_pool_2x2_row_avx2(const float *row0, const float *row1, float *output, int output_width)
+{
+    int j = 0;
+    for (; j + 8 <= output_width; j += 8)
+    {
+        __m256 m0 = _mm256_max_ps(_mm256_loadu_ps(row0 + 2 * j), _mm256_loadu_ps(row1 + 2 * j));
+        __m256 m1 = _mm256_max_ps(_mm256_loadu_ps(row0 + 2 * j + 8), _mm256_loadu_ps(row1 + 2 * j + 8));
+        // Even and odd columns per 128-bit lane, then restore the pair order across lanes
+        __m256 even = _mm256_shuffle_ps(m0, m1, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 odd = _mm256_shuffle_ps(m0, m1, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256d pairs = _mm256_castps_pd(_mm256_max_ps(even, odd));
+        _mm256_storeu_ps(output + j, _mm256_castpd_ps(_mm256_permute4x64_pd(pairs, _MM_SHUFFLE(3, 1, 2, 0))));
+    }
+    max_pool_2x2_row_scalar(row0 + 2 * j, row1 + 2 * j, output + j, output_width - j);
+}
+#endif
 
-                    for (int kc = 0; kc < inputq_size; kc++)
-                    {
-                        for (int ky = 0; ky < kernel_size; ky++)
-                        {
-                            int padded_y = base_y + ky * dilation; // Tiền tính padded_y
-
-                            for (int kx = 0; kx < kernel_size; kx++)
-                            {
-                                int padded_x = base_x + kx * dilation; // Tiền tính padded_x
-
-                                // Kiểm tra điều kiện ngoài vòng lặp sâu nhất để tối ưu hóa
-                                if (padded_x < 0 || padded_y < 0 || padded_x >= input_width || padded_y >= input_height)
-                                {
-                                    cnt_zero += 1;
-                                }
-                                else
-                                {
-                                    // Lưu trữ biến tạm để tránh truy cập nhiều lần vào mảng
-                                    qtype bit_1 = input_quant[kc*padded_y*padded_x].t.bit_1;
-                                    qtype bit_0 = input_quant[kc*padded_y*padded_x].t.bit_0;
-                                    qtype weight_t0 = layer->weights_t0[co*kc*ky*kx];
-                                    qtype weight_t1 = layer->weights_t1[co*kc*ky*kx];
-
-                                    qtype result_bit0 = (bit_1 & weight_t0) | (bit_0 & weight_t1);
-                                    qtype result_bit1 = (bit_1 & weight_t1) | (bit_0 & weight_t0);
-
-                                    // Sử dụng các hàm đếm bit đã tối ưu
-                                    cnt_minus_one += bitCount(result_bit0);
-                                    cnt_one += bitCount(result_bit1);
-                                }
-                            }
-                        }
-                    }
-                    // Cập nhật kết quả đầu ra
-                    output[co*y*x] = (float)(cnt_one - cnt_minus_one);
-                }
-            }
-        }
+typedef struct
+{
+    const float *input;
+    int input_height, input_width;
+    int output_height, output_width;
+    int kernel_size, stride;
+    float *output;
+} max_pool_job;
 
-        break;
-    case FP:
-    // printf("%d\n",output_channel*input_channel*kernel_size*kernel_size);
-#ifdef MC
-    #pragma omp parallel for collapse(3)
-#endif
-        for (int co = 0; co < output_channel; co++)
+static void max_pool_2x2_planes(void *arg, int begin, int end)
+{
+    const max_pool_job *job = (const max_pool_job *)arg;
+    int input_height = job->input_height, input_width = job->input_width;
+    int output_height = job->output_height, output_width = job->output_width;
+    const qcad_kernels *kernels = qcad_get_kernels();
+    for (int c = begin; c < end; c++)
+    {
+        for (int i = 0; i < output_height; i++)
         {
-            for (int y = 0; y < output_height; y++)
-            {
-                for (int x = 0; x < output_width; x++)
-                {
-                    float sum = 0.0;
-                    for (int kc = 0; kc < input_channel; kc++)
-                    {
-                        for (int ky = 0; ky < kernel_size; ky++)
-                        {
-                            for (int kx = 0; kx < kernel_size; kx++)
-                            {
-                                // Tính toán lại chỉ số thay vì lưu lại giá trị để sử dụng lại
-                                int ih = y * layer->stride - layer->padding + ky * layer->dilation;
-                                int iw = x * layer->stride - layer->padding + kx * layer->dilation;
-                                if (ih >= 0 && ih < input_height && iw >= 0 && iw < input_width)
-                                {
-                                    sum += input[kc*ih*iw] * layer->weights_f[co*kc*ky*kx];
-                                }
-                            }
-                        }
-                    }
-                    output[co*y*x] = sum;
-                }
-            }
+            const float *row0 = job->input + ((size_t)c * input_height + 2 * i) * input_width;
+            kernels->max_pool_2x2_row(row0, row0 + input_width, job->output + ((size_t)c * output_height + i) * output_width, output_width);
         }
-        break;
     }
-    
-    free(input);
-    return output;
-    
 }
 
+/**
+ * @brief 2x2 max pooling with stride 2 over a (channel, height, width) tensor.
+ *
+ * Channels are split over the thread pool. The input is freed and the pooled tensor of size
+ * (channel, height / 2, width / 2) is returned.
+ */
 float *max_pooling_2d(float *input, int input_channels, int input_height, int input_width)
 {
     int output_height = input_height / 2;
     int output_width = input_width / 2;
-    float *output = (float*)malloc(input_channels * output_height * output_width * sizeof(float*));
-    for (int c = 0; c < input_channels; c++)
-    {
-        for (int i = 0; i < output_height; i++)
-        {
-            for (int j = 0; j < output_width; j++)
-            {
-                float max_value = -FLT_MAX;
-                for (int m = 0; m < 2; m++)
-                {
-                    for (int n = 0; n < 2; n++)
-                    {
-                        int input_x = i * 2 + m;
-                        int input_y = j * 2 + n;
-                        if (input[c*input_x*input_y] > max_value)
-                        {
-                            max_value = input[c*input_x*input_y];
-                        }
-                    }
-                }
-                output[c*i*j] = max_value;
-            }
-        }
-    }
+    float *output = (float*)malloc((size_t)input_channels * output_height * output_width * sizeof(float));
+    max_pool_job job = {input, input_height, input_width, output_height, output_width, 2, 2, output};
+    qcad_parallel_for(input_channels, 1, max_pool_2x2_planes, &job);
     free(input);
     return output;
 }
 
-float *max_pooling_2d_k(float *input, int input_channels, int input_height, int input_width, int kernel_size, int stride)
+static void max_pool_planes(void *arg, int begin, int end)
 {
-    // Tính toán kích thước output
-    int output_height = (input_height - kernel_size) / stride + 1;
-    int output_width = (input_width - kernel_size) / stride + 1;
-    // printf("%d %d\n", output_height, output_width);
-    // Cấp phát mảng 3D cho output
-    float *output = (float *)malloc(input_channels * output_height * output_width * sizeof(float));
+    const max_pool_job *job = (const max_pool_job *)arg;
+    const float *input = job->input;
+    int input_height = job->input_height, input_width = job->input_width;
+    int output_height = job->output_height, output_width = job->output_width;
+    int kernel_size = job->kernel_size, stride = job->stride;
+    float *output = job->output;
     // Duyệt qua các channel
-    for (int c = 0; c < input_channels; c++)
+    for (int c = begin; c < end; c++)
     {
         // Duyệt qua chiều cao và chiều rộng của output
         for (int i = 0; i < output_height; i++)
@@ -483,17 +2077,49 @@ float *max_pooling_2d_k(float *input, int input_channels, int input_height, int
                         int input_y = j * stride + n;
                         // printf("%d %d %d\n", c, input_x, input_y);
                         // Kiểm tra giá trị max trong kernel
-                        if (input[c*input_x*input_y] > max_value)
+                        float value = input[((size_t)c * input_height + input_x) * input_width + input_y];
+                        if (value > max_value)
                         {
-                            max_value = input[c*input_x*input_y];
+                            max_value = value;
                         }
                     }
                 }
                 // Gán giá trị max vào output
-                output[c*i*j] = max_value;
+                output[((size_t)c * output_height + i) * output_width + j] = max_value;
             }
         }
     }
+}
+
+float *max_pooling_2d_k(float *input, int input_channels, int input_height, int input_width, int kernel_size, int stride)
+{
+    // Tính toán kích thước output
+    int output_height = (input_height - kernel_size) / stride + 1;
+    int output_width = (input_width - kernel_size) / stride + 1;
+    // printf("%d %d\n", output_height, output_width);
+    // Cấp phát mảng 3D cho output
+    float *output = (float *)malloc((size_t)input_channels * output_height * output_width * sizeof(float));
+    max_pool_job job = {input, input_height, input_width, output_height, output_width, kernel_size, stride, output};
+    qcad_parallel_for(input_channels, 1, max_pool_planes, &job);
     free(input);
     return output;
 }
+
+/**
+ * @brief 2x2, stride 2 max pooling over an (N, channel, height, width) batch.
+ *
+ * Pooling is per plane, so the batch is pooled as N * channel planes split over the thread
+ * pool. The input is freed.
+ */
+float *max_pooling_2d_batch(float *inputs, int N, int input_channels, int input_height, int input_width)
+{
+    return max_pooling_2d(inputs, N * input_channels, input_height, input_width);
+}
+
+/**
+ * @brief max_pooling_2d_k over an (N, channel, height, width) batch. The input is freed.
+ */
+float *max_pooling_2d_k_batch(float *inputs, int N, int input_channels, int input_height, int input_width, int kernel_size, int stride)
+{
+    return max_pooling_2d_k(inputs, N * input_channels, input_height, input_width, kernel_size, stride);
+}
@@ -1,24 +1,57 @@
 #ifndef CONV_H
 #define CONV_H
 #include "utils.h"
+#include "packed.h"
+#include "igemm.h"
 #include <math.h>
-typedef struct {
+typedef struct conv2d_layer {
     int input_channel;
     int output_channel;
     int kernel_size;
     int stride;
     int padding;
     int dilation;
-    float input_thres; 
+    float input_thres; // INT8: activation clipping range, 0 for a per-input range
+    channel_thres *out_thres; // Per-channel output thresholds for packed outputs, NULL to use next_thres
     quant_type quant;
+    int act_bits;    // MBIT: bits per activation, 1 .. MBIT_MAX_BITS
+    int weight_bits; // MBIT: bits per weight, applied by conv2d_prepack
     union {
         qtype *weights_b;    // For BNN and TBN layer
         struct {
-            qtype *weights_t0; //(output channel, input channel, kernelsize, kernelsize)
+            qtype *weights_t0; //(output channel, kernelsize, kernelsize, packed input channel)
             qtype *weights_t1;
         };              // For TNN layer
-        float *weights_f;
+        float *weights_f;   //(output channel, input channel, kernelsize, kernelsize) For FP, INT8 and MBIT layer
+    };
+    // Weights prepacked by conv2d_prepack: register-blocked layout for quantized layers,
+    // Winograd transform for FP 3x3 layers, INT8 weights for INT8 layers, digit planes for
+    // MBIT layers. The weights above keep the original layout for export.
+    int pack_block;
+    union {
+        qtype *packed_b;    // For BNN and TBN layer
+        struct {
+            qtype *packed_t;    //(output channel / pack_block, kernelsize, kernelsize, packed input channel, 2, pack_block) nz and sign planes
+            tblock *weights_tp; //(output channel, TBLOCKS(kernelsize * kernelsize * packed input channel)) planar, for bgemm_tnn
+        };              // For TNN layer
+        float *weights_wino; //(16, output channel, input channel) Winograd F(2x2,3x3) transform, FP 3x3 stride-1 layers
+        struct {
+            int8_t *weights_q;   //(output channel, IGEMM_STRIDE(input channel * kernelsize * kernelsize))
+            float *weight_scale; //(output channel) per-channel scales of weights_q
+            int *weight_sum;     //(output channel) row sums of weights_q
+        };              // For INT8 layer
+        struct {
+            qtype *weights_planes; //(weight_bits, output channel, kernelsize, kernelsize, packed input channel)
+            float *plane_scale;    //(output channel) per-channel scales of the weight levels
+        };              // For MBIT layer
     };
+    // Kernel specialized for (kernel_size, stride), chosen by create_conv2d_layer. It writes the
+    // raw results of np output pixels from p0 on (padded input) to acc (output channel, np).
+    // NULL selects the generic im2col + bgemm path.
+    void (*kernel)(const struct conv2d_layer *layer, const packed_tensor *padded, int output_width, int p0, int np, int *acc);
+    // Per-NUMA-node copies of this layer whose forward-pass weights are node-local (see numa.h),
+    // built by conv2d_prepack. NULL when the weights are not replicated or interleaved.
+    struct conv2d_layer **replicas;
 } conv2d_layer;
 
 typedef struct {
@@ -52,8 +85,19 @@ typedef union {
 } conv2d_input;
 
 conv2d_layer* create_conv2d_layer(int input_channel, int output_channel, int kernel_size, int stride, int padding, int dilation, quant_type quant);
+void conv2d_prepack(conv2d_layer *layer);
 float *conv2d_forward(conv2d_layer *layer, float *input, int input_height, int input_width);
+float *conv2d_forward_batch(conv2d_layer *layer, float *inputs, int N, int input_height, int input_width);
+packed_tensor *conv2d_forward_packed(conv2d_layer *layer, packed_tensor *input, quant_type next_quant, float next_thres);
+int8_tensor *conv2d_forward_int8_tensor(conv2d_layer *layer, int8_tensor *input, float next_thres);
+float *conv2d_pool_forward(conv2d_layer *layer, float *input, int input_height, int input_width, int pool_size, int pool_stride);
+float *conv2d_pool_forward_batch(conv2d_layer *layer, float *inputs, int N, int input_height, int input_width,
+                                 int pool_size, int pool_stride);
+packed_tensor *conv2d_pool_forward_packed(conv2d_layer *layer, packed_tensor *input, int pool_size, int pool_stride,
+                                          quant_type next_quant, float next_thres);
 
 float *max_pooling_2d(float *input, int input_channels, int input_height, int input_width);
 float *max_pooling_2d_k(float *input, int input_channels, int input_height, int input_width, int kernel_size, int stride);
+float *max_pooling_2d_batch(float *inputs, int N, int input_channels, int input_height, int input_width);
+float *max_pooling_2d_k_batch(float *inputs, int N, int input_channels, int input_height, int input_width, int kernel_size, int stride);
 #endif // CONV_H
\ No newline at end of file
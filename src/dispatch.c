@@ -0,0 +1,129 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-09-22 15:40:09
+ * @ Modified time: 2024-09-22 15:40:09
+ * @ Description: Runtime CPU feature detection and kernel selection.
+ */
+
+#include "dispatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef QCAD_X86
+#include <cpuid.h>
+#endif
+
+static const qcad_kernels kernels_scalar = {
+    QCAD_ISA_SCALAR, "scalar",
+    popcount_xor_scalar, popcount_tbn_scalar, popcount_tnn_scalar,
+    max_pool_2x2_row_scalar,
+    sgemm_kernel_scalar,
+    sgemv_kernel_scalar,
+    igemm_kernel_scalar,
+};
+
+#ifdef QCAD_X86
+static const qcad_kernels kernels_sse42 = {
+    QCAD_ISA_SSE42, "sse4.2",
+    popcount_xor_sse42, popcount_tbn_sse42, popcount_tnn_sse42,
+    max_pool_2x2_row_scalar,
+    sgemm_kernel_scalar,
+    sgemv_kernel_scalar,
+    igemm_kernel_sse42,
+};
+
+static const qcad_kernels kernels_avx2 = {
+    QCAD_ISA_AVX2, "avx2",
+    popcount_xor_avx2, popcount_tbn_avx2, popcount_tnn_avx2,
+    max_pool_2x2_row_avx2,
+    sgemm_kernel_avx2,
+    sgemv_kernel_avx2,
+    igemm_kernel_avx2,
+};
+#endif
+
+static const qcad_kernels *active_kernels = NULL;
+
+/**
+ * @brief Detects the best instruction set usable on this host.
+ *
+ * AVX2 additionally requires FMA and the OS to save the YMM state (OSXSAVE and XCR0 bits 1-2).
+ */
+qcad_isa qcad_detect_isa(void)
+{
+#ifdef QCAD_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+        return QCAD_ISA_SCALAR;
+    }
+    if (!(ecx & bit_POPCNT) || !(ecx & bit_SSE4_2))
+    {
+        return QCAD_ISA_SCALAR;
+    }
+    if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX) && (ecx & bit_FMA))
+    {
+        unsigned int xcr0_lo, xcr0_hi;
+        __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        if ((xcr0_lo & 0x6) == 0x6 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2))
+        {
+            return QCAD_ISA_AVX2;
+        }
+    }
+    return QCAD_ISA_SSE42;
+#else
+    return QCAD_ISA_SCALAR;
+#endif
+}
+
+static const qcad_kernels *kernels_for(qcad_isa isa)
+{
+    switch (isa)
+    {
+#ifdef QCAD_X86
+    case QCAD_ISA_AVX2:
+        return &kernels_avx2;
+    case QCAD_ISA_SSE42:
+        return &kernels_sse42;
+#endif
+    default:
+        return &kernels_scalar;
+    }
+}
+
+__attribute__((constructor)) static void qcad_dispatch_init(void)
+{
+    qcad_isa isa = qcad_detect_isa();
+    const char *env = getenv("QCAD_ISA");
+    if (env != NULL)
+    {
+        qcad_isa wanted = isa;
+        if (strcmp(env, "scalar") == 0)
+            wanted = QCAD_ISA_SCALAR;
+        else if (strcmp(env, "sse42") == 0)
+            wanted = QCAD_ISA_SSE42;
+        else if (strcmp(env, "avx2") == 0)
+            wanted = QCAD_ISA_AVX2;
+        else
+            fprintf(stderr, "qcad: unknown QCAD_ISA '%s' ignored\n", env);
+        if (wanted > isa)
+            fprintf(stderr, "qcad: QCAD_ISA=%s is not supported by this CPU\n", env);
+        else
+            isa = wanted;
+    }
+    active_kernels = kernels_for(isa);
+    fprintf(stderr, "qcad: using %s kernels\n", active_kernels->name);
+}
+
+/**
+ * @brief Returns the kernel table chosen at startup.
+ */
+const qcad_kernels *qcad_get_kernels(void)
+{
+    if (active_kernels == NULL)
+    {
+        qcad_dispatch_init();
+    }
+    return active_kernels;
+}
@@ -0,0 +1,56 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QCAD_X86
+#endif
+
+typedef enum {
+    QCAD_ISA_SCALAR,
+    QCAD_ISA_SSE42,
+    QCAD_ISA_AVX2
+} qcad_isa;
+
+/*
+ * Kernel table selected once at startup from cpuid. Every variant is compiled into the
+ * same binary through target attributes, so the Makefile does not need -mavx2 and the
+ * build runs on any x86-64 host. QCAD_ISA=scalar|sse42|avx2 lowers the selection.
+ */
+typedef struct {
+    qcad_isa isa;
+    const char *name;
+    int (*popcount_xor)(const qtype *a, const qtype *b, int n);
+    int (*popcount_tbn)(const qtype *w, const tblock *in, int n);
+    int (*popcount_tnn)(const tblock *w, const tblock *in, int n);
+    void (*max_pool_2x2_row)(const float *row0, const float *row1, float *output, int output_width);
+    void (*sgemm_kernel)(int kc, const float *Ap, const float *Bp, float *C, int ldc, int mr, int nr);
+    void (*sgemv_kernel)(int rows, int K, const float *A, int lda, const float *x, float *y);
+    void (*igemm_kernel)(int mr, int nr, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc);
+} qcad_kernels;
+
+const qcad_kernels *qcad_get_kernels(void);
+qcad_isa qcad_detect_isa(void);
+
+// Variants, defined next to the generic code that uses them
+int popcount_xor_scalar(const qtype *a, const qtype *b, int n);
+int popcount_tbn_scalar(const qtype *w, const tblock *in, int n);
+int popcount_tnn_scalar(const tblock *w, const tblock *in, int n);
+void max_pool_2x2_row_scalar(const float *row0, const float *row1, float *output, int output_width);
+void sgemm_kernel_scalar(int kc, const float *Ap, const float *Bp, float *C, int ldc, int mr, int nr);
+void sgemv_kernel_scalar(int rows, int K, const float *A, int lda, const float *x, float *y);
+void igemm_kernel_scalar(int mr, int nr, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc);
+#ifdef QCAD_X86
+int popcount_xor_sse42(const qtype *a, const qtype *b, int n);
+int popcount_tbn_sse42(const qtype *w, const tblock *in, int n);
+int popcount_tnn_sse42(const tblock *w, const tblock *in, int n);
+int popcount_xor_avx2(const qtype *a, const qtype *b, int n);
+int popcount_tbn_avx2(const qtype *w, const tblock *in, int n);
+int popcount_tnn_avx2(const tblock *w, const tblock *in, int n);
+void max_pool_2x2_row_avx2(const float *row0, const float *row1, float *output, int output_width);
+void sgemm_kernel_avx2(int kc, const float *Ap, const float *Bp, float *C, int ldc, int mr, int nr);
+void sgemv_kernel_avx2(int rows, int K, const float *A, int lda, const float *x, float *y);
+void igemm_kernel_sse42(int mr, int nr, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc);
+void igemm_kernel_avx2(int mr, int nr, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc);
+#endif
+#endif // DISPATCH_H
@@ -0,0 +1,317 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-10-02 10:21:37
+ * @ Modified time: 2024-10-02 10:21:37
+ * @ Description: INT8 (u8 x s8) GEMM with SSSE3/AVX2 maddubs micro-kernels and INT8 quantization.
+ */
+
+#include "igemm.h"
+#include "dispatch.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef QCAD_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Micro-kernels: C[0:mr][0:nr] = A[0:mr] . B[0:nr] over K bytes, K a multiple of
+ * IGEMM_KALIGN. Missing rows of a partial tile alias the last valid row and are not stored.
+ */
+void igemm_kernel_scalar(int mr, int nr, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc)
+{
+    for (int i = 0; i < mr; i++)
+    {
+        for (int j = 0; j < nr; j++)
+        {
+            const int8_t *a = A + (size_t)i * lda;
+            const uint8_t *b = B + (size_t)j * ldb;
+            int sum = 0;
+            for (int k = 0; k < K; k++)
+            {
+                sum += (int)b[k] * a[k];
+            }
+            C[i * ldc + j] = sum;
+        }
+    }
+}
+
+#ifdef QCAD_X86
+__attribute__((target("ssse3"))) static inline int hsum128_epi32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+/*
+ * One step of the u8 x s8 dot product: pmaddubsw multiplies the bytes and adds adjacent
+ * pairs into 16 bits, pmaddwd by ones widens adjacent pairs into 32-bit lanes.
+ */
+#define IGEMM_STEP128(acc, x, w) acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_maddubs_epi16(x, w), ones))
+#define IGEMM_STEP256(acc, x, w) acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(x, w), ones))
+
+__attribute__((target("ssse3"))) void igemm_kernel_sse42(int mr, int nr, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc)
+{
+    const int8_t *a[IGEMM_MR];
+    const uint8_t *b[IGEMM_NR];
+    for (int i = 0; i < IGEMM_MR; i++)
+        a[i] = A + (size_t)(i < mr ? i : mr - 1) * lda;
+    for (int j = 0; j < IGEMM_NR; j++)
+        b[j] = B + (size_t)(j < nr ? j : nr - 1) * ldb;
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i c[IGEMM_MR][IGEMM_NR];
+    for (int i = 0; i < IGEMM_MR; i++)
+        for (int j = 0; j < IGEMM_NR; j++)
+            c[i][j] = _mm_setzero_si128();
+    for (int k = 0; k < K; k += 16)
+    {
+        __m128i x0 = _mm_loadu_si128((const __m128i *)(b[0] + k));
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(b[1] + k));
+        for (int i = 0; i < IGEMM_MR; i++)
+        {
+            __m128i w = _mm_loadu_si128((const __m128i *)(a[i] + k));
+            IGEMM_STEP128(c[i][0], x0, w);
+            IGEMM_STEP128(c[i][1], x1, w);
+        }
+    }
+    for (int i = 0; i < mr; i++)
+        for (int j = 0; j < nr; j++)
+            C[i * ldc + j] = hsum128_epi32(c[i][j]);
+}
+
+__attribute__((target("avx2"))) static inline int hsum256_epi32(__m256i v)
+{
+    return hsum128_epi32(_mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2"))) void igemm_kernel_avx2(int mr, int nr, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc)
+{
+    // 4 x 2 tile in 8 accumulators, 2 activation vectors, 1 weight vector and the ones
+    const int8_t *a0 = A;
+    const int8_t *a1 = A + (size_t)(mr > 1 ? 1 : 0) * lda;
+    const int8_t *a2 = A + (size_t)(mr > 2 ? 2 : mr - 1) * lda;
+    const int8_t *a3 = A + (size_t)(mr > 3 ? 3 : mr - 1) * lda;
+    const uint8_t *b0 = B;
+    const uint8_t *b1 = B + (size_t)(nr > 1 ? 1 : 0) * ldb;
+    const __m256i ones = _mm256_set1_epi16(1);
+    if (nr == 1)
+    {
+        // GEMV (one sample): a 4 x 1 tile, two chains per row to hide the add latency
+        __m256i c[IGEMM_MR][2];
+        for (int i = 0; i < IGEMM_MR; i++)
+            c[i][0] = c[i][1] = _mm256_setzero_si256();
+        int k = 0;
+        for (; k + 64 <= K; k += 64)
+        {
+            __m256i x0 = _mm256_loadu_si256((const __m256i *)(b0 + k));
+            __m256i x1 = _mm256_loadu_si256((const __m256i *)(b0 + k + 32));
+            IGEMM_STEP256(c[0][0], x0, _mm256_loadu_si256((const __m256i *)(a0 + k)));
+            IGEMM_STEP256(c[0][1], x1, _mm256_loadu_si256((const __m256i *)(a0 + k + 32)));
+            IGEMM_STEP256(c[1][0], x0, _mm256_loadu_si256((const __m256i *)(a1 + k)));
+            IGEMM_STEP256(c[1][1], x1, _mm256_loadu_si256((const __m256i *)(a1 + k + 32)));
+            IGEMM_STEP256(c[2][0], x0, _mm256_loadu_si256((const __m256i *)(a2 + k)));
+            IGEMM_STEP256(c[2][1], x1, _mm256_loadu_si256((const __m256i *)(a2 + k + 32)));
+            IGEMM_STEP256(c[3][0], x0, _mm256_loadu_si256((const __m256i *)(a3 + k)));
+            IGEMM_STEP256(c[3][1], x1, _mm256_loadu_si256((const __m256i *)(a3 + k + 32)));
+        }
+        if (k < K)
+        {
+            __m256i x0 = _mm256_loadu_si256((const __m256i *)(b0 + k));
+            IGEMM_STEP256(c[0][0], x0, _mm256_loadu_si256((const __m256i *)(a0 + k)));
+            IGEMM_STEP256(c[1][0], x0, _mm256_loadu_si256((const __m256i *)(a1 + k)));
+            IGEMM_STEP256(c[2][0], x0, _mm256_loadu_si256((const __m256i *)(a2 + k)));
+            IGEMM_STEP256(c[3][0], x0, _mm256_loadu_si256((const __m256i *)(a3 + k)));
+        }
+        for (int i = 0; i < mr; i++)
+        {
+            C[i * ldc] = hsum256_epi32(_mm256_add_epi32(c[i][0], c[i][1]));
+        }
+        return;
+    }
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+    for (int k = 0; k < K; k += 32)
+    {
+        __m256i x0 = _mm256_loadu_si256((const __m256i *)(b0 + k));
+        __m256i x1 = _mm256_loadu_si256((const __m256i *)(b1 + k));
+        __m256i w;
+        w = _mm256_loadu_si256((const __m256i *)(a0 + k));
+        IGEMM_STEP256(c00, x0, w);
+        IGEMM_STEP256(c01, x1, w);
+        w = _mm256_loadu_si256((const __m256i *)(a1 + k));
+        IGEMM_STEP256(c10, x0, w);
+        IGEMM_STEP256(c11, x1, w);
+        w = _mm256_loadu_si256((const __m256i *)(a2 + k));
+        IGEMM_STEP256(c20, x0, w);
+        IGEMM_STEP256(c21, x1, w);
+        w = _mm256_loadu_si256((const __m256i *)(a3 + k));
+        IGEMM_STEP256(c30, x0, w);
+        IGEMM_STEP256(c31, x1, w);
+    }
+    __m256i acc[IGEMM_MR][IGEMM_NR] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}};
+    for (int i = 0; i < mr; i++)
+    {
+        for (int j = 0; j < nr; j++)
+        {
+            C[i * ldc + j] = hsum256_epi32(acc[i][j]);
+        }
+    }
+}
+#endif
+
+/**
+ * @brief INT8 GEMM: C[m][n] = sum_k A[m][k] * B[n][k], A signed and B unsigned bytes.
+ *
+ * The zero point of B is not removed here; the caller subtracts IGEMM_ZERO times the row
+ * sums of A (see igemm_quantize_weights).
+ *
+ * @param M Number of rows of A (output channels).
+ * @param N Number of rows of B (output pixels / samples).
+ * @param K Reduction length in bytes, a multiple of IGEMM_KALIGN.
+ * @param C Output matrix, row stride ldc. It is overwritten.
+ */
+void igemm_u8s8(int M, int N, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc)
+{
+    void (*kernel)(int, int, int, const int8_t *, int, const uint8_t *, int, int *, int) = qcad_get_kernels()->igemm_kernel;
+    for (int mb = 0; mb < M; mb += IGEMM_MC)
+    {
+        int mc = (M - mb < IGEMM_MC) ? M - mb : IGEMM_MC;
+        for (int n = 0; n < N; n += IGEMM_NR)
+        {
+            int nr = (N - n < IGEMM_NR) ? N - n : IGEMM_NR;
+            for (int m = mb; m < mb + mc; m += IGEMM_MR)
+            {
+                int mr = (mb + mc - m < IGEMM_MR) ? mb + mc - m : IGEMM_MR;
+                kernel(mr, nr, K, A + (size_t)m * lda, lda, B + (size_t)n * ldb, ldb, C + (size_t)m * ldc + n, ldc);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Quantizes (M x K) float weights symmetrically per row: w ~ scale[m] * q, q in
+ *        [-127, 127].
+ *
+ * @param scale Receives the M row scales.
+ * @param sum Receives the M row sums of q, used to remove the activation zero point.
+ *
+ * @return The quantized rows, IGEMM_STRIDE(K) bytes each with a zero tail, 32-byte aligned.
+ */
+int8_t *igemm_quantize_weights(const float *W, int M, int K, float *scale, int *sum)
+{
+    int stride = IGEMM_STRIDE(K);
+    int8_t *Q = (int8_t *)aligned_alloc(32, (size_t)M * stride > 0 ? (size_t)M * stride : IGEMM_KALIGN);
+    if (Q == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for INT8 weights\n");
+        exit(1);
+    }
+    memset(Q, 0, (size_t)M * stride);
+    for (int m = 0; m < M; m++)
+    {
+        const float *w = W + (size_t)m * K;
+        float amax = 0.0f;
+        for (int k = 0; k < K; k++)
+        {
+            amax = fabsf(w[k]) > amax ? fabsf(w[k]) : amax;
+        }
+        scale[m] = (amax > 0.0f) ? amax / 127.0f : 1.0f;
+        sum[m] = 0;
+        for (int k = 0; k < K; k++)
+        {
+            int q = (int)lrintf(w[k] / scale[m]);
+            q = q < -127 ? -127 : (q > 127 ? 127 : q);
+            Q[(size_t)m * stride + k] = (int8_t)q;
+            sum[m] += q;
+        }
+    }
+    return Q;
+}
+
+/**
+ * @brief Scale of an activation tensor: x ~ scale * (q - IGEMM_ZERO).
+ *
+ * @param range Clipping range |x| <= range of a calibrated layer. When it is not positive
+ *              the range is taken from the n values of x (dynamic quantization).
+ */
+float igemm_input_scale(const float *x, size_t n, float range)
+{
+    if (range <= 0.0f)
+    {
+        range = abs_max(x, n);
+    }
+    return (range > 0.0f) ? range / (IGEMM_ZERO - 1) : 1.0f;
+}
+
+/**
+ * @brief Allocates a zeroed INT8 activation tensor with the given scale.
+ */
+int8_tensor *create_int8_tensor(int channel, int height, int width, float scale)
+{
+    int8_tensor *tensor = (int8_tensor *)malloc(sizeof(int8_tensor));
+    size_t size = (size_t)channel * height * width;
+    if (tensor == NULL || (tensor->q = (uint8_t *)calloc(IGEMM_STRIDE(size), 1)) == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for INT8 tensor\n");
+        exit(1);
+    }
+    tensor->channel = channel;
+    tensor->height = height;
+    tensor->width = width;
+    tensor->scale = scale;
+    tensor->zero = IGEMM_ZERO;
+    return tensor;
+}
+
+/**
+ * @brief Quantizes a (channel, height, width) float tensor for an INT8 layer.
+ *
+ * @param range Clipping range, see igemm_input_scale; 0 takes it from the input.
+ */
+int8_tensor *quantize_int8_tensor(const float *input, int channel, int height, int width, float range)
+{
+    size_t size = (size_t)channel * height * width;
+    int8_tensor *tensor = create_int8_tensor(channel, height, width, igemm_input_scale(input, size, range));
+    float inv_scale = 1.0f / tensor->scale;
+    for (size_t i = 0; i < size; i++)
+    {
+        tensor->q[i] = igemm_quant(input[i], inv_scale);
+    }
+    return tensor;
+}
+
+/**
+ * @brief Returns the float values of an INT8 activation tensor, laid out (channel, height,
+ *        width).
+ */
+float *dequantize_int8_tensor(const int8_tensor *tensor)
+{
+    size_t size = (size_t)tensor->channel * tensor->height * tensor->width;
+    float *output = (float *)malloc(size * sizeof(float));
+    if (output == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for dequantized tensor\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        output[i] = tensor->scale * (float)(tensor->q[i] - tensor->zero);
+    }
+    return output;
+}
+
+void free_int8_tensor(int8_tensor *tensor)
+{
+    if (tensor == NULL)
+    {
+        return;
+    }
+    free(tensor->q);
+    free(tensor);
+}
@@ -0,0 +1,57 @@
+#ifndef IGEMM_H
+#define IGEMM_H
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+
+/*
+ * INT8 GEMM for the INT8 layers.
+ *
+ * Like bgemm, A is the (M x K) weight matrix and B the (N x K) activation matrix, both
+ * row-major with K innermost, and C[m * ldc + n] is the dot product of row m of A with
+ * row n of B. Weights are signed 8-bit, quantized symmetrically per output channel.
+ * Activations are unsigned 7-bit, quantized per tensor around the zero point IGEMM_ZERO,
+ * so that the u8 x s8 pair sums of vpmaddubsw (at most 2 * 127 * 127) never saturate
+ * 16 bits. Rows are zero-padded to IGEMM_STRIDE(K) bytes.
+ */
+#define IGEMM_MR 4     // output channels per micro-kernel call
+#define IGEMM_NR 2     // output pixels / samples per micro-kernel call
+#define IGEMM_MC 64    // rows of A kept hot in L2
+#define IGEMM_KALIGN 32 // row padding, one ymm register of bytes
+#define IGEMM_ZERO 64  // activation zero point
+#define IGEMM_STRIDE(K) (((K) + IGEMM_KALIGN - 1) / IGEMM_KALIGN * IGEMM_KALIGN)
+
+/**
+ * @brief Quantizes one activation with the reciprocal of its tensor scale.
+ */
+static inline uint8_t igemm_quant(float x, float inv_scale)
+{
+    float q = x * inv_scale;
+    q = q < (float)-IGEMM_ZERO ? (float)-IGEMM_ZERO : (q > (float)(IGEMM_ZERO - 1) ? (float)(IGEMM_ZERO - 1) : q);
+    return (uint8_t)(lrintf(q) + IGEMM_ZERO);
+}
+
+/*
+ * Activation tensor passed between INT8 layers (see conv2d_forward_int8_tensor), laid out
+ * (channel, height, width) like the float activations, with x ~ scale * (q - zero). It holds
+ * the kernels' input format, so zero is always IGEMM_ZERO and the values are 7-bit; q is
+ * zero-padded to IGEMM_STRIDE(channel * height * width) bytes so a linear layer reads it as
+ * one GEMM row.
+ */
+typedef struct {
+    int channel;
+    int height;
+    int width;
+    float scale;
+    int zero;
+    uint8_t *q;
+} int8_tensor;
+
+void igemm_u8s8(int M, int N, int K, const int8_t *A, int lda, const uint8_t *B, int ldb, int *C, int ldc);
+int8_t *igemm_quantize_weights(const float *W, int M, int K, float *scale, int *sum);
+float igemm_input_scale(const float *x, size_t n, float range);
+int8_tensor *create_int8_tensor(int channel, int height, int width, float scale);
+int8_tensor *quantize_int8_tensor(const float *input, int channel, int height, int width, float range);
+float *dequantize_int8_tensor(const int8_tensor *tensor);
+void free_int8_tensor(int8_tensor *tensor);
+#endif // IGEMM_H
@@ -8,11 +8,18 @@
 
 #include "utils.h"
 #include "linear.h"
+#include "popcount.h"
+#include "bgemm.h"
+#include "sgemm.h"
+#include "igemm.h"
+#include "threadpool.h"
+#include "numa.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 // #include <x86_64-linux-gnu/cblas.h>
+#define LINEAR_TILE_WORDS (262144 / SIZEQUANT) // packed weight words per thread, at least
 /**
  * create_linear_layer
  * @brief Creates and initializes a linear layer with specified input and output channels, and quantization type.
@@ -27,6 +34,10 @@
  *              - BNN: Binary Neural Network
  *              - TBN: Ternary Binary Neural Network
  *              - TNN: Ternary Neural Network
+ *              - FP: Floating point
+ *              - INT8: 8-bit weights and activations, quantized from weights_f by linear_prepack
+ *              - MBIT: act_bits / weight_bits bit-serial activations and weights (2 / 2 by default;
+ *                call linear_prepack after changing them), weights quantized from weights_f
  *
  * @return A pointer to the initialized linear_layer structure.
  */
@@ -38,6 +49,7 @@ linear_layer *create_linear_layer(int input_channel, int output_channel, quant_t
     layer->output_channel = output_channel;
     layer->quant = quant;
     layer->input_thres = 0.0;
+    layer->out_thres = NULL;
 
     int weight_size = (input_channel % SIZEQUANT) == 0 ? (input_channel / SIZEQUANT) * output_channel : (input_channel / SIZEQUANT + 1) * output_channel;
     switch (quant)
@@ -66,6 +78,8 @@ linear_layer *create_linear_layer(int input_channel, int output_channel, quant_t
         }
         break;
     case FP:
+    case INT8:
+    case MBIT:
         // printf("%d \n", input_channel * output_channel);
         layer->weights_f = (float *)malloc(input_channel * output_channel * sizeof(float));
         if (layer->weights_f == NULL)
@@ -79,9 +93,591 @@ linear_layer *create_linear_layer(int input_channel, int output_channel, quant_t
         fprintf(stderr, "create_linear_layer: Unknown quantization type \n");
         exit(1);
     }
+    layer->weights_q = NULL;
+    layer->weight_scale = NULL;
+    layer->weight_sum = NULL;
+    layer->act_bits = 2;
+    layer->weight_bits = 2;
+    layer->replicas = NULL;
+    linear_prepack(layer);
     return layer;
 }
 
+/**
+ * @brief Builds the planar rows of a TNN layer, or quantizes the float weights of an INT8
+ *        or MBIT (weight_bits digit planes) layer per output channel.
+ *
+ * Unlike conv, whose tile kernels read blocks of output channels, linear layers keep no
+ * output-channel blocked copy: their row dot products and bgemm calls read rows.
+ */
+static void linear_pack_weights(linear_layer *layer)
+{
+    if (layer->quant == FP)
+    {
+        return;
+    }
+    if (layer->quant == MBIT)
+    {
+        if (layer->act_bits < 1 || layer->act_bits > MBIT_MAX_BITS || layer->weight_bits < 1 || layer->weight_bits > MBIT_MAX_BITS)
+        {
+            fprintf(stderr, "linear_prepack: MBIT bits must be in 1..%d\n", MBIT_MAX_BITS);
+            exit(1);
+        }
+        free(layer->weights_planes);
+        free(layer->plane_scale);
+        layer->plane_scale = (float *)malloc(layer->output_channel * sizeof(float));
+        if (layer->plane_scale == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for weight planes\n");
+            exit(1);
+        }
+        layer->weights_planes = pack_weight_planes(layer->weights_f, layer->output_channel, layer->input_channel, 1,
+                                                   layer->weight_bits, layer->plane_scale);
+        return;
+    }
+    if (layer->quant == INT8)
+    {
+        free(layer->weights_q);
+        free(layer->weight_scale);
+        free(layer->weight_sum);
+        layer->weight_scale = (float *)malloc(layer->output_channel * sizeof(float));
+        layer->weight_sum = (int *)malloc(layer->output_channel * sizeof(int));
+        if (layer->weight_scale == NULL || layer->weight_sum == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for INT8 weights\n");
+            exit(1);
+        }
+        layer->weights_q = igemm_quantize_weights(layer->weights_f, layer->output_channel, layer->input_channel,
+                                                  layer->weight_scale, layer->weight_sum);
+        return;
+    }
+    if (layer->quant == TNN)
+    {
+        int inputq_size = (layer->input_channel % SIZEQUANT) ? (layer->input_channel / SIZEQUANT + 1) : (layer->input_channel / SIZEQUANT);
+        free(layer->weights_tp);
+        layer->weights_tp = bgemm_planar_tnn(layer->weights_t0, layer->weights_t1, layer->output_channel, inputq_size);
+    }
+}
+
+/**
+ * @brief Weight buffers read by the forward pass of a prepacked layer, as (field, size in
+ *        bytes) pairs. Returns their number.
+ */
+static int linear_weight_buffers(linear_layer *layer, void **fields[1], size_t sizes[1])
+{
+    size_t K = (layer->input_channel + SIZEQUANT - 1) / SIZEQUANT;
+    size_t co = layer->output_channel;
+    int n = 0;
+    switch (layer->quant)
+    {
+    case BNN:
+    case TBN:
+        fields[n] = (void **)&layer->weights_b;
+        sizes[n++] = co * K * sizeof(qtype);
+        break;
+    case TNN:
+        fields[n] = (void **)&layer->weights_tp;
+        sizes[n++] = co * TBLOCKS(K) * sizeof(tblock);
+        break;
+    case FP:
+        fields[n] = (void **)&layer->weights_f;
+        sizes[n++] = co * layer->input_channel * sizeof(float);
+        break;
+    case INT8:
+        fields[n] = (void **)&layer->weights_q;
+        sizes[n++] = co * IGEMM_STRIDE(layer->input_channel);
+        break;
+    case MBIT:
+        fields[n] = (void **)&layer->weights_planes;
+        sizes[n++] = (size_t)layer->weight_bits * co * K * sizeof(qtype);
+        break;
+    default:
+        break;
+    }
+    return n;
+}
+
+static void linear_numa_release(linear_layer *layer)
+{
+    if (layer->replicas == NULL)
+    {
+        return;
+    }
+    for (int node = 0; node < qcad_numa_nodes(); node++)
+    {
+        linear_layer *copy = layer->replicas[node];
+        if (node > 0 && copy == layer->replicas[node - 1])
+        {
+            continue; // interleaved: one copy shared by every node
+        }
+        void **fields[1];
+        size_t sizes[1];
+        int n = linear_weight_buffers(copy, fields, sizes);
+        for (int i = 0; i < n; i++)
+        {
+            free(*fields[i]);
+        }
+        free(copy);
+    }
+    free(layer->replicas);
+    layer->replicas = NULL;
+}
+
+/**
+ * @brief Rebuilds the node-local copies of the layer under the NUMA policy (see numa.h), as
+ *        conv2d_prepack does for convolutions.
+ */
+static void linear_numa_place(linear_layer *layer)
+{
+    linear_numa_release(layer);
+    qcad_numa_policy policy = qcad_get_numa_policy();
+    int nodes = qcad_numa_nodes();
+    if (policy == QCAD_NUMA_OFF || nodes < 2)
+    {
+        return;
+    }
+    layer->replicas = (linear_layer **)malloc(nodes * sizeof(linear_layer *));
+    if (layer->replicas == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for layer replicas\n");
+        exit(1);
+    }
+    for (int node = 0; node < nodes; node++)
+    {
+        if (policy == QCAD_NUMA_INTERLEAVE && node > 0)
+        {
+            layer->replicas[node] = layer->replicas[0];
+            continue;
+        }
+        linear_layer *copy = (linear_layer *)malloc(sizeof(linear_layer));
+        if (copy == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed for layer replicas\n");
+            exit(1);
+        }
+        *copy = *layer;
+        copy->replicas = NULL;
+        void **fields[1];
+        size_t sizes[1];
+        int n = linear_weight_buffers(copy, fields, sizes);
+        for (int i = 0; i < n; i++)
+        {
+            *fields[i] = (policy == QCAD_NUMA_REPLICATE) ? qcad_numa_copy(*fields[i], sizes[i], node)
+                                                         : qcad_numa_interleave(*fields[i], sizes[i]);
+        }
+        layer->replicas[node] = copy;
+    }
+}
+
+/**
+ * @brief Prepares the weights of a layer for the forward pass: linear_pack_weights, then the
+ *        NUMA placement of the buffers the forward pass reads (see numa.h).
+ *
+ * Runs at creation; call it again whenever the weights are overwritten (e.g. after loading
+ * a model) or the NUMA policy is changed. The original weights are kept unchanged for export.
+ */
+void linear_prepack(linear_layer *layer)
+{
+    linear_pack_weights(layer);
+    linear_numa_place(layer);
+}
+
+/**
+ * @brief The copy of the layer whose weights are local to the calling thread's node (see
+ *        linear_numa_place).
+ */
+static linear_layer *linear_local(linear_layer *layer)
+{
+    return (layer->replicas != NULL) ? layer->replicas[qcad_numa_node()] : layer;
+}
+
+/**
+ * @brief Signed dot product of output row i of a quantized layer with a packed input vector.
+ *
+ * input_b is used by BNN layers and the planar input_t by TBN/TNN layers. nonzero is
+ * popcount_nonzero(input_t) for TBN layers, shared by all output rows.
+ */
+static inline int linear_dot(linear_layer *layer, const qtype *input_b, const tblock *input_t, int nonzero, int i)
+{
+    int input_channel = layer->input_channel;
+    int inputq_size = (input_channel % SIZEQUANT) ? (input_channel / SIZEQUANT + 1) : (input_channel / SIZEQUANT);
+    switch (layer->quant)
+    {
+    case BNN:
+    {
+        int cnt_minus_one = popcount_xor(input_b, layer->weights_b + (size_t)i * inputq_size, inputq_size);
+        int cnt_one = input_channel - cnt_minus_one;
+        return cnt_one - cnt_minus_one;
+    }
+    case TBN:
+        return 2 * popcount_tbn(layer->weights_b + (size_t)i * inputq_size, input_t, inputq_size) - nonzero;
+    case TNN:
+        return popcount_tnn(layer->weights_tp + (size_t)i * TBLOCKS(inputq_size), input_t, inputq_size);
+    default:
+        return 0;
+    }
+}
+
+typedef struct
+{
+    linear_layer *layer;
+    const qtype *input_b;
+    const tblock *input_t;
+    int nonzero;
+    int *dots;
+} linear_dot_job;
+
+static void linear_dot_rows(void *arg, int begin, int end)
+{
+    const linear_dot_job *job = (const linear_dot_job *)arg;
+    linear_layer *layer = linear_local(job->layer);
+    for (int i = begin; i < end; i++)
+    {
+        job->dots[i] = linear_dot(layer, job->input_b, job->input_t, job->nonzero, i);
+    }
+}
+
+/**
+ * @brief Signed dot products of every output row with a packed input vector, output rows
+ *        split over the thread pool.
+ */
+static void linear_dots(linear_layer *layer, const qtype *input_b, const tblock *input_t, int nonzero, int *dots)
+{
+    int inputq_size = (layer->input_channel + SIZEQUANT - 1) / SIZEQUANT;
+    int grain = LINEAR_TILE_WORDS / inputq_size;
+    linear_dot_job job = {layer, input_b, input_t, nonzero, dots};
+    qcad_parallel_for(layer->output_channel, grain, linear_dot_rows, &job);
+}
+
+/**
+ * @brief Quantizes one input vector with the layer's input_thres into input_b (BNN,
+ *        inputq_size words) or the planar input_t (TBN/TNN, TBLOCKS(inputq_size) tblocks).
+ */
+static void linear_pack_input(const linear_layer *layer, const float *input, qtype *input_b, tblock *input_t)
+{
+    int input_channel = layer->input_channel;
+    int inputq_size = (input_channel % SIZEQUANT) ? (input_channel / SIZEQUANT + 1) : (input_channel / SIZEQUANT);
+    float input_thres = layer->input_thres;
+    if (layer->quant == BNN)
+    {
+        memset(input_b, 0, inputq_size * sizeof(qtype));
+        for (int k = 0; k < input_channel; k++)
+        {
+            if (input[k] < input_thres)
+            {
+                input_b[k / SIZEQUANT] |= QBIT(k % SIZEQUANT);
+            }
+        }
+        return;
+    }
+    memset(input_t, 0, TBLOCKS(inputq_size) * sizeof(tblock));
+    for (int k = 0; k < input_channel; k++)
+    {
+        tblock *block = input_t + k / SIZEQUANT / TBLOCK_WORDS;
+        int lane = k / SIZEQUANT % TBLOCK_WORDS;
+        if (input[k] >= input_thres)
+        {
+            block->nz[lane] |= QBIT(k % SIZEQUANT);
+        }
+        else if (input[k] <= -input_thres)
+        {
+            block->nz[lane] |= QBIT(k % SIZEQUANT);
+            block->sign[lane] |= QBIT(k % SIZEQUANT);
+        }
+    }
+}
+
+typedef struct
+{
+    linear_layer *layer;
+    const float *inputs;
+    int N, ldb;
+    qtype *input_b;
+    tblock *input_t;
+    int *C;
+} linear_batch_job;
+
+static void linear_pack_samples(void *arg, int begin, int end)
+{
+    const linear_batch_job *job = (const linear_batch_job *)arg;
+    for (int n = begin; n < end; n++)
+    {
+        linear_pack_input(job->layer, job->inputs + (size_t)n * job->layer->input_channel,
+                          job->input_b + (size_t)n * job->ldb, job->input_t + (size_t)n * job->ldb);
+    }
+}
+
+/**
+ * @brief Runs the packed-bit GEMM of linear_forward_batch for the output channel blocks
+ *        [begin, end) of BGEMM_MC rows.
+ */
+static void linear_gemm_blocks(void *arg, int begin, int end)
+{
+    const linear_batch_job *job = (const linear_batch_job *)arg;
+    const linear_layer *layer = linear_local(job->layer);
+    int inputq_size = (layer->input_channel + SIZEQUANT - 1) / SIZEQUANT;
+    int m0 = begin * BGEMM_MC;
+    int m1 = (end * BGEMM_MC < layer->output_channel) ? end * BGEMM_MC : layer->output_channel;
+    int *C = job->C + (size_t)m0 * job->N;
+    if (layer->quant == BNN)
+        bgemm_bnn(m1 - m0, job->N, inputq_size, layer->weights_b + (size_t)m0 * inputq_size, inputq_size,
+                  job->input_b, job->ldb, C, job->N);
+    else if (layer->quant == TBN)
+        bgemm_tbn(m1 - m0, job->N, inputq_size, layer->weights_b + (size_t)m0 * inputq_size, inputq_size,
+                  job->input_t, job->ldb, C, job->N);
+    else
+        bgemm_tnn(m1 - m0, job->N, inputq_size, layer->weights_tp + (size_t)m0 * job->ldb, job->ldb,
+                  job->input_t, job->ldb, C, job->N);
+}
+
+typedef struct
+{
+    linear_layer *layer;
+    const float *x; // input vector (N = 1) or inputs^T (input channel x N)
+    int N, block;
+    float *y;       // output vector (N = 1) or output^T (output channel x N)
+} linear_fp_job;
+
+/**
+ * @brief Runs sgemv (N = 1) or sgemm for the blocks [begin, end) of output channels on the
+ *        node-local copy of the FP weights.
+ */
+static void linear_fp_blocks(void *arg, int begin, int end)
+{
+    const linear_fp_job *job = (const linear_fp_job *)arg;
+    const linear_layer *layer = linear_local(job->layer);
+    int ci = layer->input_channel;
+    int m0 = begin * job->block;
+    int m1 = (end * job->block < layer->output_channel) ? end * job->block : layer->output_channel;
+    const float *A = layer->weights_f + (size_t)m0 * ci;
+    if (job->N == 1)
+        sgemv(m1 - m0, ci, A, ci, job->x, job->y + m0);
+    else
+        sgemm(m1 - m0, job->N, ci, A, ci, job->x, job->N, job->y + (size_t)m0 * job->N, job->N);
+}
+
+/**
+ * @brief FP product y = weights_f * x for an input vector (N = 1, sgemv) or the N columns of
+ *        x (sgemm). With NUMA replicas the output channels are split over the pool here, so
+ *        that each worker reads its node's weights; sgemm / sgemv then run inline.
+ */
+static void linear_forward_fp(linear_layer *layer, const float *x, int N, float *y)
+{
+    int M = layer->output_channel;
+    int K = layer->input_channel;
+    if (layer->replicas == NULL)
+    {
+        if (N == 1)
+            sgemv(M, K, layer->weights_f, K, x, y);
+        else
+            sgemm(M, N, K, layer->weights_f, K, x, N, y, N);
+        return;
+    }
+    int block = (N == 1) ? SGEMV_BLOCK : SGEMM_MC;
+    linear_fp_job job = {layer, x, N, block, y};
+    qcad_parallel_for((M + block - 1) / block, 1, linear_fp_blocks, &job);
+}
+
+typedef struct
+{
+    linear_layer *layer;
+    const uint8_t *X; // quantized samples, IGEMM_STRIDE(input channel) bytes each
+    const float *scale;
+    int N;
+    int *C;
+    float *output;
+    uint8_t *output_q;   // requantized output instead of output when not NULL
+    float inv_out_scale; // reciprocal of the scale of output_q
+} linear_int8_job;
+
+/**
+ * @brief Runs igemm_u8s8 and the epilogue of linear_forward_int8 for the output channel
+ *        blocks [begin, end) of IGEMM_MC rows, on the node-local copy of the weights.
+ */
+static void linear_int8_blocks(void *arg, int begin, int end)
+{
+    const linear_int8_job *job = (const linear_int8_job *)arg;
+    const linear_layer *layer = linear_local(job->layer);
+    int output_channel = layer->output_channel;
+    int stride = IGEMM_STRIDE(layer->input_channel);
+    int N = job->N;
+    int m0 = begin * IGEMM_MC;
+    int m1 = (end * IGEMM_MC < output_channel) ? end * IGEMM_MC : output_channel;
+    igemm_u8s8(m1 - m0, N, stride, layer->weights_q + (size_t)m0 * stride, stride, job->X, stride,
+               job->C + (size_t)m0 * N, N);
+    for (int n = 0; n < N; n++)
+    {
+        for (int i = m0; i < m1; i++)
+        {
+            int acc = job->C[(size_t)i * N + n] - IGEMM_ZERO * layer->weight_sum[i];
+            float requant = job->scale[n] * layer->weight_scale[i];
+            if (job->output_q != NULL)
+                job->output_q[(size_t)n * output_channel + i] = igemm_quant((float)acc, requant * job->inv_out_scale);
+            else
+                job->output[(size_t)n * output_channel + i] = (float)acc * requant;
+        }
+    }
+}
+
+/**
+ * @brief INT8 product of N quantized samples (X, IGEMM_STRIDE(input channel) bytes each,
+ *        with their scales) into output (N, output channel), or into 7-bit values of scale
+ *        out_scale when output_q is not NULL.
+ *
+ * The output channels are split over the pool in blocks of IGEMM_MC rows, so that a single
+ * sample (N = 1) runs on every thread like sgemv; each block runs igemm_u8s8 over all
+ * samples, and its epilogue removes the zero point and requantizes the int32 results with
+ * the input and per-channel weight scales.
+ */
+static void linear_gemm_int8(linear_layer *layer, const uint8_t *X, const float *scale, int N, float *output,
+                             uint8_t *output_q, float out_scale)
+{
+    int output_channel = layer->output_channel;
+    int *C = (int *)malloc((size_t)output_channel * N * sizeof(int));
+    if (C == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for INT8 buffers\n");
+        exit(1);
+    }
+    linear_int8_job job = {layer, X, scale, N, C, output, output_q, (output_q != NULL) ? 1.0f / out_scale : 0.0f};
+    qcad_parallel_for((output_channel + IGEMM_MC - 1) / IGEMM_MC, 1, linear_int8_blocks, &job);
+    free(C);
+}
+
+/**
+ * @brief INT8 forward pass of N samples laid out (N, input channel) into output (N, output
+ *        channel). Each sample is quantized to 7-bit unsigned values with its own scale (see
+ *        igemm_input_scale).
+ */
+static void linear_forward_int8(linear_layer *layer, const float *inputs, int N, float *output)
+{
+    int input_channel = layer->input_channel;
+    int stride = IGEMM_STRIDE(input_channel);
+    uint8_t *X = (uint8_t *)calloc((size_t)N * stride, 1);
+    float *scale = (float *)malloc(N * sizeof(float));
+    if (X == NULL || scale == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for INT8 buffers\n");
+        exit(1);
+    }
+    for (int n = 0; n < N; n++)
+    {
+        const float *x = inputs + (size_t)n * input_channel;
+        scale[n] = igemm_input_scale(x, input_channel, layer->input_thres);
+        float inv_scale = 1.0f / scale[n];
+        for (int k = 0; k < input_channel; k++)
+        {
+            X[(size_t)n * stride + k] = igemm_quant(x[k], inv_scale);
+        }
+    }
+    linear_gemm_int8(layer, X, scale, N, output, NULL, 0.0f);
+    free(X);
+    free(scale);
+}
+
+typedef struct
+{
+    linear_layer *layer;
+    const qtype *X; // activation digit planes, row i * N + n for plane i of sample n
+    const float *scale;
+    int N;
+    int *C;
+    float *output;
+} linear_bitserial_job;
+
+/**
+ * @brief Runs the bgemm_bnn calls and the epilogue of linear_forward_bitserial for the output
+ *        channel blocks [begin, end) of BGEMM_MC channels, on the node-local copy of the
+ *        weight planes.
+ */
+static void linear_bitserial_blocks(void *arg, int begin, int end)
+{
+    const linear_bitserial_job *job = (const linear_bitserial_job *)arg;
+    const linear_layer *layer = linear_local(job->layer);
+    int input_channel = layer->input_channel;
+    int output_channel = layer->output_channel;
+    int abits = layer->act_bits;
+    int wbits = layer->weight_bits;
+    int inputq_size = (input_channel % SIZEQUANT) ? (input_channel / SIZEQUANT + 1) : (input_channel / SIZEQUANT);
+    int N = job->N;
+    int cols = abits * N;
+    int o0 = begin * BGEMM_MC;
+    int o1 = (end * BGEMM_MC < output_channel) ? end * BGEMM_MC : output_channel;
+    for (int j = 0; j < wbits; j++)
+    {
+        size_t row = (size_t)j * output_channel + o0;
+        bgemm_bnn(o1 - o0, cols, inputq_size, layer->weights_planes + row * inputq_size, inputq_size, job->X,
+                  inputq_size, job->C + row * cols, cols);
+    }
+    for (int n = 0; n < N; n++)
+    {
+        for (int o = o0; o < o1; o++)
+        {
+            int64_t sum = 0;
+            for (int j = 0; j < wbits; j++)
+            {
+                const int *row = job->C + ((size_t)j * output_channel + o) * cols;
+                for (int i = 0; i < abits; i++)
+                {
+                    // BNN: mismatch count to +1/-1 dot product
+                    sum += (int64_t)(input_channel - 2 * row[i * N + n]) * ((int64_t)1 << (i + j));
+                }
+            }
+            job->output[(size_t)n * output_channel + o] = (float)sum * job->scale[n] * layer->plane_scale[o];
+        }
+    }
+}
+
+/**
+ * @brief Bit-serial (MBIT) forward pass of N samples laid out (N, input channel) into output
+ *        (N, output channel).
+ *
+ * Each sample is quantized into act_bits digit planes with its own scale, stored as rows
+ * i * N + n of one packed matrix. The output channels are split over the pool in blocks of
+ * BGEMM_MC; for each block, one bgemm_bnn call per weight plane yields every (weight plane,
+ * activation plane) BNN dot product, which the epilogue sums with weights 2^(i + j) and
+ * rescales.
+ */
+static void linear_forward_bitserial(linear_layer *layer, const float *inputs, int N, float *output)
+{
+    int input_channel = layer->input_channel;
+    int output_channel = layer->output_channel;
+    int abits = layer->act_bits;
+    int wbits = layer->weight_bits;
+    int inputq_size = (input_channel % SIZEQUANT) ? (input_channel / SIZEQUANT + 1) : (input_channel / SIZEQUANT);
+    int cols = abits * N;
+    qtype *X = (qtype *)calloc((size_t)cols * inputq_size, sizeof(qtype));
+    float *scale = (float *)malloc(N * sizeof(float));
+    int *C = (int *)malloc((size_t)wbits * output_channel * cols * sizeof(int));
+    if (X == NULL || scale == NULL || C == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for MBIT buffers\n");
+        exit(1);
+    }
+    for (int n = 0; n < N; n++)
+    {
+        const float *x = inputs + (size_t)n * input_channel;
+        scale[n] = bitserial_scale(x, input_channel, layer->input_thres, abits);
+        float inv_scale = 1.0f / scale[n];
+        for (int k = 0; k < input_channel; k++)
+        {
+            int code = bitserial_code(x[k], inv_scale, abits);
+            for (int i = 0; i < abits; i++)
+            {
+                if (!((code >> i) & 1))
+                {
+                    X[((size_t)i * N + n) * inputq_size + k / SIZEQUANT] |= QBIT(k % SIZEQUANT);
+                }
+            }
+        }
+    }
+    linear_bitserial_job job = {layer, X, scale, N, C, output};
+    qcad_parallel_for((output_channel + BGEMM_MC - 1) / BGEMM_MC, 1, linear_bitserial_blocks, &job);
+    free(X);
+    free(scale);
+    free(C);
+}
+
 /**
  * @brief Performs the forward pass for a linear layer with quantized inputs.
  *
@@ -98,39 +694,23 @@ float *linear_forward(linear_layer *layer, float *input)
 {
     int input_channel = layer->input_channel;
     int output_channel = layer->output_channel;
-    float input_thres = layer->input_thres;
     quant_type quant = layer->quant;
     
     float *output = (float *)malloc(output_channel * sizeof(float));
     int inputq_size = (input_channel % SIZEQUANT) ? (input_channel / SIZEQUANT + 1) : (input_channel / SIZEQUANT);
 
-    linear_input input_quant[inputq_size];
+    qtype input_b[quant == BNN ? inputq_size : 1];
+    tblock input_t[quant == TBN || quant == TNN ? TBLOCKS(inputq_size) : 1];
     switch (quant)
     {
     case BNN:
-        for (int k = 0; k < input_channel; k++)
-        {
-            if (input[k] < input_thres)
-            {
-                input_quant[k / SIZEQUANT].b |= 1 << (k % SIZEQUANT);
-            }
-        }
-        break;
     case TBN:
     case TNN:
-        for (int k = 0; k < input_channel; k++)
-        {
-            if (input[k] > input_thres)
-            {
-                input_quant[k / SIZEQUANT].t.bit_1 |= 1 << (k % SIZEQUANT);
-            }
-            else if (input[k] < -input_thres)
-            {
-                input_quant[k / SIZEQUANT].t.bit_0 |= 1 << (k % SIZEQUANT);
-            }
-        }
+        linear_pack_input(layer, input, input_b, input_t);
         break;
     case FP:
+    case INT8:
+    case MBIT:
         break;
     default:
         fprintf(stderr, "linear_forward: Unknown quantization type\n");
@@ -140,66 +720,221 @@ float *linear_forward(linear_layer *layer, float *input)
     switch (quant)
     {
     case BNN:
+    case TBN:
+    case TNN:
+    {
+        int nonzero = (quant == TBN) ? popcount_nonzero(input_t, inputq_size) : 0;
+        int dots[output_channel];
+        linear_dots(layer, input_b, input_t, nonzero, dots);
         for (int i = 0; i < output_channel; ++i)
         {
-            int cnt_minus_one = 0;
-            for (int j = 0; j < inputq_size; ++j)
-            {
-                qtype result_bit = (input_quant[j].b) ^ (layer->weights_b[i * inputq_size + j]);
-                cnt_minus_one += bitCount(result_bit);
-            }
-            int cnt_one = input_channel - cnt_minus_one;
-            output[i] = (float)(cnt_one - cnt_minus_one);
+            output[i] = (float)dots[i];
         }
-        // printf("%f %f %f\n", output[0], output[1], output[2]);
         break;
+    }
+    case FP:
+        linear_forward_fp(layer, input, 1, output);
+        break;
+    case INT8:
+        linear_forward_int8(layer, input, 1, output);
+        break;
+    case MBIT:
+        linear_forward_bitserial(layer, input, 1, output);
+        break;
+    default:
+        break;
+    }
+    free(input);
+    return output;
+}
+
+/**
+ * @brief Forward pass of a linear layer on a batch of N samples.
+ *
+ * One pass over the weights serves the whole batch: quantized layers pack the N samples
+ * into an (N x packed input channel) matrix and run the packed-bit GEMM (bgemm_*), FP layers
+ * run sgemm, INT8 layers igemm_u8s8 and MBIT layers bgemm_bnn over their digit planes.
+ * Every weight cache line is thus reused N times instead of being streamed once per sample.
+ * Packing is split over the thread pool by sample and the packed-bit GEMM by blocks of
+ * BGEMM_MC output channels.
+ *
+ * @param layer Pointer to the linear_layer structure containing the layer parameters.
+ * @param inputs Input samples laid out (N, input channel). It is freed.
+ * @param N Number of samples.
+ *
+ * @return The outputs laid out (N, output channel).
+ */
+float *linear_forward_batch(linear_layer *layer, float *inputs, int N)
+{
+    int input_channel = layer->input_channel;
+    int output_channel = layer->output_channel;
+    int inputq_size = (input_channel % SIZEQUANT) ? (input_channel / SIZEQUANT + 1) : (input_channel / SIZEQUANT);
+    float *output = (float *)malloc((size_t)N * output_channel * sizeof(float));
+    if (output == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for batch output\n");
+        exit(1);
+    }
+
+    switch (layer->quant)
+    {
+    case BNN:
     case TBN:
-    
-        for (int i = 0; i < output_channel; ++i)
+    case TNN:
+    {
+        // Ternary rows are planar, TBLOCKS(inputq_size) tblocks each
+        int ldb = (layer->quant == BNN) ? inputq_size : TBLOCKS(inputq_size);
+        size_t elem = (layer->quant == BNN) ? sizeof(qtype) : sizeof(tblock);
+        void *packed = malloc((size_t)N * ldb * elem);
+        int *C = (int *)malloc((size_t)output_channel * N * sizeof(int));
+        if (packed == NULL || C == NULL)
         {
-            int cnt_minus_one = 0;
-            int cnt_one = 0;
-            for (int j = 0; j < inputq_size; ++j)
+            fprintf(stderr, "Memory allocation failed for batch buffers\n");
+            exit(1);
+        }
+        linear_batch_job job = {layer, inputs, N, ldb, (qtype *)packed, (tblock *)packed, C};
+        qcad_parallel_for(N, 1, linear_pack_samples, &job);
+        qcad_parallel_for((output_channel + BGEMM_MC - 1) / BGEMM_MC, 1, linear_gemm_blocks, &job);
+
+        for (int n = 0; n < N; n++)
+        {
+            for (int i = 0; i < output_channel; i++)
             {
-                qtype weight = layer->weights_b[i * inputq_size + j];
-                qtype i_weight = ~weight;
-                qtype result_bit0 = (input_quant[j].t.bit_1 & i_weight) | (input_quant[j].t.bit_0 & weight);
-                qtype result_bit1 = (input_quant[j].t.bit_1 & weight) | (input_quant[j].t.bit_0 & i_weight);
-                cnt_minus_one += bitCount(result_bit0);
-                cnt_one += bitCount(result_bit1);
+                int value = C[(size_t)i * N + n];
+                // BNN: mismatch count to +1/-1 dot product
+                output[(size_t)n * output_channel + i] = (float)((layer->quant == BNN) ? input_channel - 2 * value : value);
             }
-            output[i] = (float)(cnt_one - cnt_minus_one);
         }
+        free(packed);
+        free(C);
         break;
-    case TNN:
-        for (int i = 0; i < output_channel; ++i)
+    }
+    case FP:
+    {
+        // output^T (output channel x N) = weights (output channel x input channel) * inputs^T
+        float *inputs_t = (float *)calloc((size_t)input_channel * N, sizeof(float));
+        float *output_t = (float *)malloc((size_t)output_channel * N * sizeof(float));
+        if (inputs_t == NULL || output_t == NULL)
         {
-            int cnt_minus_one = 0;
-            int cnt_one = 0;
-            for (int j = 0; j < inputq_size; ++j)
+            fprintf(stderr, "Memory allocation failed for batch buffers\n");
+            exit(1);
+        }
+        for (int n = 0; n < N; n++)
+        {
+            for (int k = 0; k < input_channel; k++)
             {
-                qtype result_bit0 = (input_quant[j].t.bit_1 & layer->weights_t0[i * inputq_size + j]) | (input_quant[j].t.bit_0 & layer->weights_t1[i * inputq_size + j]);
-                qtype result_bit1 = (input_quant[j].t.bit_1 & layer->weights_t1[i * inputq_size + j]) | (input_quant[j].t.bit_0 & layer->weights_t0[i * inputq_size + j]);
-                cnt_minus_one += bitCount(result_bit0);
-                cnt_one += bitCount(result_bit1);
+                inputs_t[(size_t)k * N + n] = inputs[(size_t)n * input_channel + k];
             }
-            output[i] = (float)(cnt_one - cnt_minus_one);
         }
-        break;
-    case FP:
-    
-        for (int i = 0; i < output_channel; ++i)
+        linear_forward_fp(layer, inputs_t, N, output_t);
+        for (int n = 0; n < N; n++)
         {
-            float sum = 0.0;
-            
-            for (int j = 0; j < input_channel; ++j)
+            for (int i = 0; i < output_channel; i++)
             {
-                sum += input[j] * layer->weights_f[i * input_channel + j];
+                output[(size_t)n * output_channel + i] = output_t[(size_t)i * N + n];
             }
-            output[i] = sum;
         }
+        free(inputs_t);
+        free(output_t);
         break;
     }
-    free(input);
+    case INT8:
+        linear_forward_int8(layer, inputs, N, output);
+        break;
+    case MBIT:
+        linear_forward_bitserial(layer, inputs, N, output);
+        break;
+    default:
+        fprintf(stderr, "linear_forward_batch: Unknown quantization type\n");
+        exit(1);
+    }
+    free(inputs);
+    return output;
+}
+
+/**
+ * @brief Forward pass of a quantized linear layer on a packed input, with a packed output.
+ *
+ * Each output is quantized with the next layer's (next_quant, next_thres) as soon as it is
+ * computed, so stacked quantized linear layers never materialize floats. When the layer has
+ * per-channel thresholds (layer->out_thres, e.g. from fold_batchnorm) they replace next_thres.
+ *
+ * @param layer Pointer to a BNN, TBN or TNN linear_layer.
+ * @param input Packed input vector (see packed_flatten for conv outputs). It is freed.
+ *
+ * @return The packed output vector of size (output_channel, 1, 1).
+ */
+packed_tensor *linear_forward_packed(linear_layer *layer, packed_tensor *input, quant_type next_quant, float next_thres)
+{
+    if (layer->quant != BNN && layer->quant != TBN && layer->quant != TNN)
+    {
+        fprintf(stderr, "linear_forward_packed: layer is not quantized\n");
+        exit(1);
+    }
+    if (input->height * input->width != 1 || input->channel != layer->input_channel || (input->quant == BNN) != (layer->quant == BNN))
+    {
+        fprintf(stderr, "linear_forward_packed: input does not match the layer\n");
+        exit(1);
+    }
+    packed_tensor *output = create_packed_tensor(next_quant, layer->output_channel, 1, 1);
+    tblock input_t[layer->quant == BNN ? 1 : TBLOCKS(input->words)];
+    int nonzero = 0;
+    if (layer->quant != BNN)
+    {
+        bgemm_planar(input->t, input->words, input_t);
+        nonzero = (layer->quant == TBN) ? popcount_nonzero(input_t, input->words) : 0;
+    }
+    // Output channels share packed words, so they are stored after the parallel dot products
+    int dots[layer->output_channel];
+    linear_dots(layer, input->b, input_t, nonzero, dots);
+    for (int i = 0; i < layer->output_channel; ++i)
+    {
+        if (layer->out_thres != NULL)
+            packed_store_channel(output, 0, i, dots[i], layer->out_thres);
+        else
+            packed_store(output, 0, i, (float)dots[i], next_thres);
+    }
+    free_packed_tensor(input);
+    return output;
+}
+
+/**
+ * @brief Forward pass of an INT8 linear layer on an INT8 input, with an INT8 output.
+ *
+ * See conv2d_forward_int8_tensor. The input, e.g. the output of an INT8 convolution, is read
+ * flattened in (channel, height, width) order, so no reshaping is needed.
+ *
+ * @param layer Pointer to an INT8 linear_layer.
+ * @param input INT8 input of input channel values. It is freed.
+ * @param next_thres Input clipping range of the layer that consumes the output, 0 for a
+ *                   per-output range.
+ *
+ * @return The INT8 output tensor, (output channel, 1, 1).
+ */
+int8_tensor *linear_forward_int8_tensor(linear_layer *layer, int8_tensor *input, float next_thres)
+{
+    if (layer->quant != INT8)
+    {
+        fprintf(stderr, "linear_forward_int8_tensor: layer is not an INT8 layer\n");
+        exit(1);
+    }
+    if (input->channel * input->height * input->width != layer->input_channel || input->zero != IGEMM_ZERO)
+    {
+        fprintf(stderr, "linear_forward_int8_tensor: input does not match the layer\n");
+        exit(1);
+    }
+    int8_tensor *output;
+    if (next_thres > 0.0f)
+    {
+        output = create_int8_tensor(layer->output_channel, 1, 1, igemm_input_scale(NULL, 0, next_thres));
+        linear_gemm_int8(layer, input->q, &input->scale, 1, NULL, output->q, output->scale);
+    }
+    else
+    {
+        float values[layer->output_channel];
+        linear_gemm_int8(layer, input->q, &input->scale, 1, values, NULL, 0.0f);
+        output = quantize_int8_tensor(values, layer->output_channel, 1, 1, 0.0f);
+    }
+    free_int8_tensor(input);
     return output;
 }
@@ -1,20 +1,43 @@
 #ifndef LINEAR_H
 #define LINEAR_H
 #include "utils.h"
+#include "packed.h"
+#include "igemm.h"
 
-typedef struct {
+typedef struct linear_layer {
     int input_channel;
     int output_channel;
-    float input_thres; 
+    float input_thres; // INT8: activation clipping range, 0 for a per-input range
+    channel_thres *out_thres; // Per-channel output thresholds for packed outputs, NULL to use next_thres
     union {
         qtype *weights_b;    // For BNN and TBN layer
         struct {
             qtype *weights_t0;
             qtype *weights_t1;
         };              // For TNN layer
-        float *weights_f;
+        float *weights_f;   //(output channel, input channel) For FP, INT8 and MBIT layer
     };
     quant_type quant;
+    int act_bits;    // MBIT: bits per activation, 1 .. MBIT_MAX_BITS
+    int weight_bits; // MBIT: bits per weight, applied by linear_prepack
+    // Weights prepared by linear_prepack: planar TNN rows, INT8 weights for INT8 layers, digit
+    // planes for MBIT layers; the weights above keep the original layout for export. BNN and
+    // TBN rows are read as they are (popcount_xor / bgemm_bnn take weights_b directly).
+    union {
+        tblock *weights_tp; //(output channel, TBLOCKS(packed input channel)) planar, for bgemm_tnn; TNN layer
+        struct {
+            int8_t *weights_q;   //(output channel, IGEMM_STRIDE(input channel))
+            float *weight_scale; //(output channel) per-channel scales of weights_q
+            int *weight_sum;     //(output channel) row sums of weights_q
+        };              // For INT8 layer
+        struct {
+            qtype *weights_planes; //(weight_bits, output channel, packed input channel)
+            float *plane_scale;    //(output channel) per-channel scales of the weight levels
+        };              // For MBIT layer
+    };
+    // Per-NUMA-node copies of this layer whose forward-pass weights are node-local (see numa.h),
+    // built by linear_prepack. NULL when the weights are not replicated or interleaved.
+    struct linear_layer **replicas;
 } linear_layer;
 
 typedef union {
@@ -23,5 +46,9 @@ typedef union {
 } linear_input;
 
 linear_layer* create_linear_layer(int input_channel, int output_channel, quant_type quant);
+void linear_prepack(linear_layer *layer);
 float* linear_forward(linear_layer* layer, float* input);
+float *linear_forward_batch(linear_layer *layer, float *inputs, int N);
+packed_tensor *linear_forward_packed(linear_layer *layer, packed_tensor *input, quant_type next_quant, float next_thres);
+int8_tensor *linear_forward_int8_tensor(linear_layer *layer, int8_tensor *input, float next_thres);
 #endif // LINEAR_H
\ No newline at end of file
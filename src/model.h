@@ -3,6 +3,7 @@
 #include "utils.h"
 #include "linear.h"
 #include "conv.h"
+#include "threadpool.h"
 
 typedef enum {
     LINEAR,
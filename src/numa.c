@@ -0,0 +1,267 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-10-17 10:20:31
+ * @ Modified time: 2024-10-17 10:20:31
+ * @ Description: NUMA topology, thread binding and first-touch placement of weights.
+ */
+
+#define _GNU_SOURCE
+#include "numa.h"
+#include "affinity.h"
+#include "threadpool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUMA_PAGE 4096
+
+static struct
+{
+    int nodes;
+    cpu_set_t cpus[QCAD_MAX_NODES];
+    qcad_numa_policy policy;
+} topology;
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static __thread int bound_node = -1;
+
+/**
+ * @brief Splits the allowed CPUs into n simulated nodes of consecutive CPUs. With fewer CPUs
+ *        than nodes, nodes share CPUs.
+ */
+static void simulate_nodes(const int *cpus, int count, int n)
+{
+    topology.nodes = n;
+    for (int node = 0; node < n; node++)
+    {
+        CPU_ZERO(&topology.cpus[node]);
+        int first = count * node / n;
+        int last = count * (node + 1) / n;
+        if (first == last)
+        {
+            CPU_SET(cpus[node % count], &topology.cpus[node]);
+        }
+        for (int i = first; i < last; i++)
+        {
+            CPU_SET(cpus[i], &topology.cpus[node]);
+        }
+    }
+}
+
+static void topology_init(void)
+{
+    int cpus[QCAD_MAX_CPUS];
+    int count = qcad_allowed_cpus(cpus, QCAD_MAX_CPUS);
+    const char *simulate = getenv("QCAD_NUMA_SIMULATE");
+    if (simulate != NULL && atoi(simulate) > 0)
+    {
+        int n = atoi(simulate);
+        simulate_nodes(cpus, count, n < QCAD_MAX_NODES ? n : QCAD_MAX_NODES);
+    }
+    else
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        for (int i = 0; i < count; i++)
+        {
+            CPU_SET(cpus[i], &allowed);
+        }
+        // Node ids may be sparse, and memory-only nodes have no CPUs to bind to
+        for (int id = 0; id < 1024 && topology.nodes < QCAD_MAX_NODES; id++)
+        {
+            char path[64], list[1024];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+            FILE *f = fopen(path, "r");
+            if (f == NULL)
+            {
+                continue;
+            }
+            if (fgets(list, sizeof(list), f) != NULL)
+            {
+                int node_cpus[QCAD_MAX_CPUS];
+                int n = qcad_parse_cpulist(list, node_cpus, QCAD_MAX_CPUS);
+                cpu_set_t *set = &topology.cpus[topology.nodes];
+                CPU_ZERO(set);
+                for (int i = 0; i < n; i++)
+                {
+                    if (node_cpus[i] < CPU_SETSIZE && CPU_ISSET(node_cpus[i], &allowed))
+                    {
+                        CPU_SET(node_cpus[i], set);
+                    }
+                }
+                if (CPU_COUNT(set) > 0)
+                {
+                    topology.nodes++;
+                }
+            }
+            fclose(f);
+        }
+        if (topology.nodes == 0)
+        {
+            topology.nodes = 1;
+            topology.cpus[0] = allowed;
+        }
+    }
+
+    const char *policy = getenv("QCAD_NUMA");
+    if (policy != NULL)
+    {
+        if (strcmp(policy, "replicate") == 0)
+            topology.policy = QCAD_NUMA_REPLICATE;
+        else if (strcmp(policy, "interleave") == 0)
+            topology.policy = QCAD_NUMA_INTERLEAVE;
+        else if (strcmp(policy, "off") != 0)
+            fprintf(stderr, "qcad: unknown QCAD_NUMA '%s' ignored\n", policy);
+    }
+}
+
+/**
+ * @brief Returns the number of NUMA nodes with CPUs (or simulated nodes).
+ */
+int qcad_numa_nodes(void)
+{
+    pthread_once(&topology_once, topology_init);
+    return topology.nodes;
+}
+
+/**
+ * @brief Returns the node of the calling thread: the node it is bound to, or else the node
+ *        of the CPU it runs on.
+ */
+int qcad_numa_node(void)
+{
+    if (bound_node >= 0)
+    {
+        return bound_node;
+    }
+    pthread_once(&topology_once, topology_init);
+    int cpu = sched_getcpu();
+    for (int node = 0; cpu >= 0 && node < topology.nodes; node++)
+    {
+        if (CPU_ISSET(cpu, &topology.cpus[node]))
+        {
+            return node;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Binds the calling thread to the CPUs of a node.
+ */
+void qcad_numa_bind(int node)
+{
+    pthread_once(&topology_once, topology_init);
+    node = node % topology.nodes;
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &topology.cpus[node]);
+    bound_node = node;
+}
+
+/**
+ * @brief Sets the placement applied by later conv2d_prepack / linear_prepack calls.
+ *
+ * The pool workers are restarted, bound to nodes when the policy is not QCAD_NUMA_OFF.
+ */
+void qcad_set_numa_policy(qcad_numa_policy policy)
+{
+    pthread_once(&topology_once, topology_init);
+    topology.policy = policy;
+    qcad_config config;
+    qcad_get_config(&config);
+    qcad_configure(&config);
+}
+
+qcad_numa_policy qcad_get_numa_policy(void)
+{
+    pthread_once(&topology_once, topology_init);
+    return topology.policy;
+}
+
+typedef struct
+{
+    const unsigned char *src;
+    unsigned char *dst;
+    size_t size;
+    int node;
+    int stride; // pages written: node, node + stride, ...
+} touch_job;
+
+/**
+ * @brief Copies every stride-th page of a buffer from a thread bound to the node, so those
+ *        pages are first touched, and thus allocated, on that node.
+ */
+static void *touch_pages(void *arg)
+{
+    const touch_job *job = (const touch_job *)arg;
+    qcad_numa_bind(job->node);
+    size_t step = (size_t)job->stride * NUMA_PAGE;
+    for (size_t offset = (size_t)(job->node % job->stride) * NUMA_PAGE; offset < job->size; offset += step)
+    {
+        size_t bytes = (job->size - offset < NUMA_PAGE) ? job->size - offset : NUMA_PAGE;
+        memcpy(job->dst + offset, job->src + offset, bytes);
+    }
+    return NULL;
+}
+
+static unsigned char *alloc_pages(size_t size)
+{
+    size_t bytes = (size + NUMA_PAGE - 1) / NUMA_PAGE * NUMA_PAGE;
+    unsigned char *buffer = (unsigned char *)aligned_alloc(NUMA_PAGE, bytes > 0 ? bytes : NUMA_PAGE);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for NUMA weights\n");
+        exit(1);
+    }
+    return buffer;
+}
+
+/**
+ * @brief Runs touch_pages for the given nodes, one thread each.
+ */
+static void touch(const touch_job *jobs, int n)
+{
+    pthread_t threads[QCAD_MAX_NODES];
+    for (int i = 0; i < n; i++)
+    {
+        if (pthread_create(&threads[i], NULL, touch_pages, (void *)&jobs[i]) != 0)
+        {
+            fprintf(stderr, "qcad: could not start a NUMA placement thread\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * @brief Returns a page-aligned copy of size bytes of src placed on node, freed with free().
+ */
+void *qcad_numa_copy(const void *src, size_t size, int node)
+{
+    unsigned char *dst = alloc_pages(size);
+    touch_job job = {(const unsigned char *)src, dst, size, node, 1};
+    touch(&job, 1);
+    return dst;
+}
+
+/**
+ * @brief Returns a page-aligned copy of size bytes of src with its pages spread round-robin
+ *        over the nodes, freed with free().
+ */
+void *qcad_numa_interleave(const void *src, size_t size)
+{
+    unsigned char *dst = alloc_pages(size);
+    int nodes = qcad_numa_nodes();
+    touch_job jobs[QCAD_MAX_NODES];
+    for (int node = 0; node < nodes; node++)
+    {
+        jobs[node] = (touch_job){(const unsigned char *)src, dst, size, node, nodes};
+    }
+    touch(jobs, nodes);
+    return dst;
+}
@@ -0,0 +1,36 @@
+#ifndef NUMA_H
+#define NUMA_H
+#include <stddef.h>
+
+/*
+ * NUMA placement of layer weights.
+ *
+ * The topology is read from /sys/devices/system/node; QCAD_NUMA_SIMULATE=n instead splits the
+ * CPUs of the process into n nodes, so the replicated paths can be exercised on a single
+ * node machine. No libnuma is needed: memory is placed by first touch, i.e. each copy is
+ * written by a thread bound to the node that should own its pages.
+ *
+ * With QCAD_NUMA_REPLICATE, conv2d_prepack / linear_prepack give every node its own copy of
+ * the weights that the forward pass reads, and the pool workers, bound to nodes, read the
+ * copy of their node. QCAD_NUMA_INTERLEAVE keeps a single copy with its pages spread over
+ * the nodes, which costs no extra memory. The policy is set with qcad_set_numa_policy or the
+ * QCAD_NUMA environment variable (replicate, interleave) and applies to layers prepacked
+ * afterwards. Under either policy the copies are only refreshed by the prepack call, so it
+ * must follow every weight update, FP layers included.
+ */
+#define QCAD_MAX_NODES 8
+
+typedef enum {
+    QCAD_NUMA_OFF,
+    QCAD_NUMA_REPLICATE,
+    QCAD_NUMA_INTERLEAVE
+} qcad_numa_policy;
+
+void qcad_set_numa_policy(qcad_numa_policy policy);
+qcad_numa_policy qcad_get_numa_policy(void);
+int qcad_numa_nodes(void);
+int qcad_numa_node(void);
+void qcad_numa_bind(int node);
+void *qcad_numa_copy(const void *src, size_t size, int node);
+void *qcad_numa_interleave(const void *src, size_t size);
+#endif // NUMA_H
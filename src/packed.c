@@ -0,0 +1,357 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-09-24 08:51:30
+ * @ Modified time: 2024-09-24 08:51:30
+ * @ Description: Packed activation tensors shared by the quantized layers.
+ */
+
+#include "packed.h"
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#define PACK_TILE_VALUES 16384 // float values quantized per thread, at least
+
+/**
+ * @brief Allocates a zero-filled packed tensor.
+ *
+ * @param quant Quantization type of the layer that will consume the tensor. BNN selects the
+ *              binary encoding, TBN and TNN the ternary one.
+ */
+packed_tensor *create_packed_tensor(quant_type quant, int channel, int height, int width)
+{
+    if (quant != BNN && quant != TBN && quant != TNN)
+    {
+        fprintf(stderr, "create_packed_tensor: Unsupported quantization type\n");
+        exit(1);
+    }
+    packed_tensor *tensor = (packed_tensor *)malloc(sizeof(packed_tensor));
+    if (tensor == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for packed tensor\n");
+        exit(1);
+    }
+    tensor->quant = quant;
+    tensor->channel = channel;
+    tensor->height = height;
+    tensor->width = width;
+    tensor->words = (channel % SIZEQUANT) ? (channel / SIZEQUANT + 1) : (channel / SIZEQUANT);
+    size_t count = (size_t)tensor->words * height * width;
+    if (quant == BNN)
+        tensor->b = (qtype *)calloc(count, sizeof(qtype));
+    else
+        tensor->t = (ttype *)calloc(count, sizeof(ttype));
+    if (tensor->b == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for packed tensor data\n");
+        exit(1);
+    }
+    return tensor;
+}
+
+typedef struct
+{
+    const float *input;
+    int channel, plane;
+    float thres;
+    packed_tensor *tensor;
+} pack_job;
+
+/**
+ * @brief Packs the pixels [begin, end) of every channel. Pixels own whole packed words, so
+ *        tiles of pixels never write the same word.
+ */
+static void pack_pixels(void *arg, int begin, int end)
+{
+    const pack_job *job = (const pack_job *)arg;
+    packed_tensor *tensor = job->tensor;
+    int plane = job->plane;
+    int words = tensor->words;
+    float thres = job->thres;
+    for (int c = 0; c < job->channel; c++)
+    {
+        qtype bit = QBIT(c % SIZEQUANT);
+        const float *src = job->input + (size_t)c * plane;
+        if (tensor->quant == BNN)
+        {
+            qtype *dst = tensor->b + c / SIZEQUANT;
+            for (int i = begin; i < end; i++)
+            {
+                if (src[i] < thres)
+                {
+                    dst[(size_t)i * words] |= bit;
+                }
+            }
+        }
+        else
+        {
+            ttype *dst = tensor->t + c / SIZEQUANT;
+            for (int i = begin; i < end; i++)
+            {
+                if (src[i] >= thres)
+                {
+                    dst[(size_t)i * words].nz |= bit;
+                }
+                else if (src[i] <= -thres)
+                {
+                    dst[(size_t)i * words].nz |= bit;
+                    dst[(size_t)i * words].sign |= bit;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Packs a (channel, height, width) float tensor for a layer of the given quantization type.
+ *
+ * BNN sets a bit for values below thres; TBN/TNN mark values >= thres as +1 and values
+ * <= -thres as -1 (see ttype). Pixels are split over the thread pool. The float input is
+ * not freed.
+ */
+packed_tensor *pack_tensor(const float *input, int channel, int height, int width, quant_type quant, float thres)
+{
+    packed_tensor *tensor = create_packed_tensor(quant, channel, height, width);
+    pack_job job = {input, channel, height * width, thres, tensor};
+    qcad_parallel_for(height * width, PACK_TILE_VALUES / channel, pack_pixels, &job);
+    return tensor;
+}
+
+/**
+ * @brief Scale of a tensor quantized to bits-bit bit-serial levels: x ~ scale * level.
+ *
+ * @param range Clipping range |x| <= range of a calibrated layer. When it is not positive
+ *              the range is taken from the n values of input.
+ */
+float bitserial_scale(const float *input, size_t n, float range, int bits)
+{
+    if (range <= 0.0f)
+    {
+        range = abs_max(input, n);
+    }
+    return (range > 0.0f) ? range / (float)((1 << bits) - 1) : 1.0f;
+}
+
+/**
+ * @brief Packs a (channel, height, width) float tensor into bits BNN-encoded digit planes
+ *        (see bitserial_code). The float input is not freed.
+ *
+ * @param planes Receives the bits planes, plane i holding digit i.
+ */
+void pack_tensor_planes(const float *input, int channel, int height, int width, int bits, float scale, packed_tensor **planes)
+{
+    for (int i = 0; i < bits; i++)
+    {
+        planes[i] = create_packed_tensor(BNN, channel, height, width);
+    }
+    int plane = height * width;
+    int words = planes[0]->words;
+    float inv_scale = 1.0f / scale;
+    for (int c = 0; c < channel; c++)
+    {
+        qtype bit = QBIT(c % SIZEQUANT);
+        const float *src = input + (size_t)c * plane;
+        for (int p = 0; p < plane; p++)
+        {
+            int code = bitserial_code(src[p], inv_scale, bits);
+            size_t word = (size_t)p * words + c / SIZEQUANT;
+            for (int i = 0; i < bits; i++)
+            {
+                if (!((code >> i) & 1))
+                {
+                    planes[i]->b[word] |= bit;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Quantizes float weights (output channel, input channel, taps) per output channel to
+ *        bits-bit bit-serial levels, w ~ scale[co] * level.
+ *
+ * @param taps Kernel taps per input channel (kernel_size^2 for conv, 1 for linear).
+ * @param scale Receives the output_channel scales.
+ *
+ * @return The digit planes laid out (bits, output channel, taps, packed input channel) in the
+ *         BNN encoding, ready for bgemm_bnn as bits * output_channel weight rows.
+ */
+qtype *pack_weight_planes(const float *weights, int output_channel, int input_channel, int taps, int bits, float *scale)
+{
+    int words = (input_channel % SIZEQUANT) ? (input_channel / SIZEQUANT + 1) : (input_channel / SIZEQUANT);
+    size_t row = (size_t)taps * words;
+    size_t plane = (size_t)output_channel * row;
+    qtype *planes = (qtype *)calloc(bits * plane, sizeof(qtype));
+    if (planes == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for weight planes\n");
+        exit(1);
+    }
+    for (int co = 0; co < output_channel; co++)
+    {
+        const float *w = weights + (size_t)co * input_channel * taps;
+        scale[co] = bitserial_scale(w, (size_t)input_channel * taps, 0.0f, bits);
+        float inv_scale = 1.0f / scale[co];
+        for (int c = 0; c < input_channel; c++)
+        {
+            for (int t = 0; t < taps; t++)
+            {
+                int code = bitserial_code(w[(size_t)c * taps + t], inv_scale, bits);
+                size_t word = co * row + (size_t)t * words + c / SIZEQUANT;
+                for (int i = 0; i < bits; i++)
+                {
+                    if (!((code >> i) & 1))
+                    {
+                        planes[i * plane + word] |= QBIT(c % SIZEQUANT);
+                    }
+                }
+            }
+        }
+    }
+    return planes;
+}
+
+/**
+ * @brief Repacks a tensor into a (channel * height * width, 1, 1) vector for a linear layer.
+ *
+ * Features are ordered like flatto1d, channel-major, so the linear weights are the same
+ * whether the previous conv layer emitted floats or bits. The input is freed.
+ */
+packed_tensor *packed_flatten(packed_tensor *input)
+{
+    int plane = input->height * input->width;
+    packed_tensor *output = create_packed_tensor(input->quant, input->channel * plane, 1, 1);
+    for (int p = 0; p < plane; p++)
+    {
+        for (int c = 0; c < input->channel; c++)
+        {
+            size_t src = (size_t)p * input->words + c / SIZEQUANT;
+            int shift = c % SIZEQUANT;
+            int k = c * plane + p;
+            if (input->quant == BNN)
+            {
+                if (QTEST(input->b[src], shift))
+                    output->b[k / SIZEQUANT] |= QBIT(k % SIZEQUANT);
+            }
+            else
+            {
+                if (QTEST(input->t[src].nz, shift))
+                    output->t[k / SIZEQUANT].nz |= QBIT(k % SIZEQUANT);
+                if (QTEST(input->t[src].sign, shift))
+                    output->t[k / SIZEQUANT].sign |= QBIT(k % SIZEQUANT);
+            }
+        }
+    }
+    free_packed_tensor(input);
+    return output;
+}
+
+/**
+ * @brief Copies a tensor into the interior of a zero-bordered (height + 2 * padding,
+ *        width + 2 * padding) tensor.
+ *
+ * Border pixels are all-zero words: 0 for ternary encodings and +1 for BNN, whose caller
+ * corrects the padded taps afterwards. Returns input itself when padding is 0; the input
+ * is never freed.
+ */
+packed_tensor *packed_pad(packed_tensor *input, int padding)
+{
+    if (padding == 0)
+    {
+        return input;
+    }
+    int width = input->width + 2 * padding;
+    packed_tensor *output = create_packed_tensor(input->quant, input->channel, input->height + 2 * padding, width);
+    size_t elem = (input->quant == BNN) ? sizeof(qtype) : sizeof(ttype);
+    size_t run = (size_t)input->width * input->words * elem;
+    for (int y = 0; y < input->height; y++)
+    {
+        size_t dst = ((size_t)(y + padding) * width + padding) * input->words;
+        size_t src = (size_t)y * input->width * input->words;
+        memcpy((char *)output->b + dst * elem, (const char *)input->b + src * elem, run);
+    }
+    return output;
+}
+
+void free_packed_tensor(packed_tensor *tensor)
+{
+    if (tensor == NULL)
+    {
+        return;
+    }
+    free(tensor->b);
+    free(tensor);
+}
+
+static int clamp_thres(double value)
+{
+    if (value >= (double)INT_MAX)
+        return INT_MAX;
+    if (value <= (double)INT_MIN)
+        return INT_MIN;
+    return (int)value;
+}
+
+/**
+ * @brief Folds BatchNorm and the next layer's binarization into integer thresholds.
+ *
+ * For y = gamma * (acc - mean) / sqrt(var + eps) + beta, the next layer sees +1 when
+ * y >= next_thres and -1 when y <= -next_thres (BNN: -1 when y < next_thres). Solving these
+ * for acc gives one integer threshold per side; channels with a negative scale compare
+ * -acc instead, which is recorded in flip.
+ *
+ * @return Thresholds for conv2d_layer/linear_layer out_thres, freed with free_channel_thres.
+ */
+channel_thres *fold_batchnorm(int channel, const float *gamma, const float *beta, const float *mean, const float *var,
+                              float eps, float next_thres)
+{
+    channel_thres *thres = (channel_thres *)malloc(sizeof(channel_thres));
+    if (thres == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for channel thresholds\n");
+        exit(1);
+    }
+    thres->channel = channel;
+    thres->pos = (int *)malloc(channel * sizeof(int));
+    thres->neg = (int *)malloc(channel * sizeof(int));
+    thres->flip = (signed char *)malloc(channel * sizeof(signed char));
+    if (thres->pos == NULL || thres->neg == NULL || thres->flip == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for channel thresholds\n");
+        exit(1);
+    }
+    for (int c = 0; c < channel; c++)
+    {
+        double scale = gamma[c] / sqrt((double)var[c] + eps);
+        if (scale == 0.0)
+        {
+            // Constant output beta: make the comparison always or never succeed
+            thres->flip[c] = 1;
+            thres->pos[c] = beta[c] >= next_thres ? INT_MIN : INT_MAX;
+            thres->neg[c] = beta[c] <= -next_thres ? INT_MAX : INT_MIN;
+            continue;
+        }
+        int flip = scale < 0.0 ? -1 : 1;
+        double upper = mean[c] + (next_thres - beta[c]) / scale;  // y >= next_thres
+        double lower = mean[c] + (-next_thres - beta[c]) / scale; // y <= -next_thres
+        thres->flip[c] = (signed char)flip;
+        thres->pos[c] = clamp_thres(ceil(flip * upper));
+        thres->neg[c] = clamp_thres(floor(flip * lower));
+    }
+    return thres;
+}
+
+void free_channel_thres(channel_thres *thres)
+{
+    if (thres == NULL)
+    {
+        return;
+    }
+    free(thres->pos);
+    free(thres->neg);
+    free(thres->flip);
+    free(thres);
+}
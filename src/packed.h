@@ -0,0 +1,120 @@
+#ifndef PACKED_H
+#define PACKED_H
+#include "utils.h"
+#include <stddef.h>
+#include <math.h>
+
+/*
+ * Quantized activation tensor passed between quantized layers, laid out channel-last
+ * [y][x][kc]. A BNN tensor holds one qtype per word (bit set for -1); TBN and TNN tensors
+ * hold one ttype per word (nz for +1 and -1, sign also set for -1). Bits past channel
+ * are always zero.
+ */
+typedef struct {
+    quant_type quant;
+    int channel;
+    int height;
+    int width;
+    int words; // packed words per pixel
+    union {
+        qtype *b;   // For BNN tensor
+        ttype *t;   // For TBN and TNN tensor
+    };
+} packed_tensor;
+
+/*
+ * Per-output-channel quantization of integer accumulators, typically BatchNorm folded
+ * together with the next layer's threshold (see fold_batchnorm). With acc' = flip[c] * acc,
+ * an output is +1 when acc' >= pos[c] and -1 when acc' <= neg[c] (ternary outputs) or
+ * acc' < pos[c] (BNN outputs).
+ */
+typedef struct {
+    int channel;
+    int *pos;
+    int *neg;
+    signed char *flip; // -1 where the BatchNorm scale is negative
+} channel_thres;
+
+/*
+ * Bit-serial multi-bit encoding (MBIT layers). A value of b bits is a sum of b digits
+ * +1/-1 weighted by powers of two, level = sum_i 2^i d_i, which is one of the 2^b odd
+ * integers in [-(2^b - 1), 2^b - 1] (a mid-rise quantizer, without zero). Digit plane i is
+ * stored in the BNN encoding, so the dot product of two such vectors is the sum over plane
+ * pairs (i, j) of 2^(i + j) times a BNN dot product, all computed by the XOR-popcount kernels.
+ */
+#define MBIT_MAX_BITS 8
+
+/**
+ * @brief Code of one value, 0 .. 2^bits - 1: bit i is set where digit i is +1.
+ */
+static inline int bitserial_code(float x, float inv_scale, int bits)
+{
+    float top = (float)((1 << bits) - 1);
+    float u = (x * inv_scale + top) * 0.5f;
+    u = u < 0.0f ? 0.0f : (u > top ? top : u);
+    return (int)lrintf(u);
+}
+
+packed_tensor *create_packed_tensor(quant_type quant, int channel, int height, int width);
+packed_tensor *pack_tensor(const float *input, int channel, int height, int width, quant_type quant, float thres);
+float bitserial_scale(const float *input, size_t n, float range, int bits);
+void pack_tensor_planes(const float *input, int channel, int height, int width, int bits, float scale, packed_tensor **planes);
+qtype *pack_weight_planes(const float *weights, int output_channel, int input_channel, int taps, int bits, float *scale);
+packed_tensor *packed_flatten(packed_tensor *input);
+packed_tensor *packed_pad(packed_tensor *input, int padding);
+void free_packed_tensor(packed_tensor *tensor);
+channel_thres *fold_batchnorm(int channel, const float *gamma, const float *beta, const float *mean, const float *var,
+                              float eps, float next_thres);
+void free_channel_thres(channel_thres *thres);
+
+/**
+ * @brief Quantizes one value with the next layer's threshold and stores it at (pixel, c).
+ *
+ * Uses the same rule as pack_tensor, so a layer that emits packed outputs produces exactly
+ * the bits the next layer would get from re-binarizing the float output.
+ */
+static inline void packed_store(packed_tensor *tensor, size_t pixel, int c, float value, float thres)
+{
+    size_t word = pixel * tensor->words + c / SIZEQUANT;
+    qtype bit = QBIT(c % SIZEQUANT);
+    if (tensor->quant == BNN)
+    {
+        if (value < thres)
+            tensor->b[word] |= bit;
+    }
+    else if (value >= thres)
+    {
+        tensor->t[word].nz |= bit;
+    }
+    else if (value <= -thres)
+    {
+        tensor->t[word].nz |= bit;
+        tensor->t[word].sign |= bit;
+    }
+}
+
+/**
+ * @brief Quantizes an integer accumulator of channel c with per-channel thresholds and
+ *        stores it at (pixel, c). The comparison stays in the integer domain.
+ */
+static inline void packed_store_channel(packed_tensor *tensor, size_t pixel, int c, int acc, const channel_thres *thres)
+{
+    size_t word = pixel * tensor->words + c / SIZEQUANT;
+    qtype bit = QBIT(c % SIZEQUANT);
+    int value = thres->flip[c] * acc;
+    if (tensor->quant == BNN)
+    {
+        if (value < thres->pos[c])
+            tensor->b[word] |= bit;
+    }
+    else if (value >= thres->pos[c])
+    {
+        tensor->t[word].nz |= bit;
+    }
+    else if (value <= thres->neg[c])
+    {
+        tensor->t[word].nz |= bit;
+        tensor->t[word].sign |= bit;
+    }
+}
+#endif // PACKED_H
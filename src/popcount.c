@@ -0,0 +1,248 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-09-21 10:03:17
+ * @ Modified time: 2024-09-21 10:03:17
+ * @ Description: Vectorized popcount reductions for the packed kernels.
+ */
+
+#include "popcount.h"
+#include "dispatch.h"
+#include <stdint.h>
+#ifdef QCAD_X86
+#include <immintrin.h>
+#endif
+
+int popcount_xor_scalar(const qtype *a, const qtype *b, int n)
+{
+    return (int)xor_words(a, b, 0, n);
+}
+
+int popcount_tbn_scalar(const qtype *w, const tblock *in, int n)
+{
+    return (int)tbn_words(w, in, 0, n);
+}
+
+int popcount_tnn_scalar(const tblock *w, const tblock *in, int n)
+{
+    return (int)tnn_words(w, in, 0, n);
+}
+
+#ifdef QCAD_X86
+__attribute__((target("popcnt,sse4.2"))) int popcount_xor_sse42(const qtype *a, const qtype *b, int n)
+{
+    return (int)xor_words(a, b, 0, n);
+}
+
+__attribute__((target("popcnt,sse4.2"))) int popcount_tbn_sse42(const qtype *w, const tblock *in, int n)
+{
+    return (int)tbn_words(w, in, 0, n);
+}
+
+__attribute__((target("popcnt,sse4.2"))) int popcount_tnn_sse42(const tblock *w, const tblock *in, int n)
+{
+    return (int)tnn_words(w, in, 0, n);
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2,popcnt")
+#define QPER256 (256 / SIZEQUANT) // packed words per ymm register
+#define HS_BLOCK 16               // vectors per Harley-Seal step
+
+// Per 64-bit lane popcount: nibble lookup with vpshufb, horizontal byte sum with vpsadbw
+static inline __m256i popcount256(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+static inline int64_t hsum256(__m256i v)
+{
+    return _mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1) + _mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3);
+}
+
+// Carry-save adder: (h, l) = a + b + c
+static inline void csa(__m256i *h, __m256i *l, __m256i a, __m256i b, __m256i c)
+{
+    __m256i u = _mm256_xor_si256(a, b);
+    *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    *l = _mm256_xor_si256(u, c);
+}
+
+typedef struct {
+    __m256i total;
+    __m256i ones;
+    __m256i twos;
+    __m256i fours;
+    __m256i eights;
+} hs_acc;
+
+static inline void hs_init(hs_acc *s)
+{
+    s->total = s->ones = s->twos = s->fours = s->eights = _mm256_setzero_si256();
+}
+
+// Folds 16 vectors into the carry-save counters; only one real popcount is issued
+static inline void hs_block(hs_acc *s, const __m256i *v)
+{
+    __m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b, sixteens;
+    csa(&twos_a, &s->ones, s->ones, v[0], v[1]);
+    csa(&twos_b, &s->ones, s->ones, v[2], v[3]);
+    csa(&fours_a, &s->twos, s->twos, twos_a, twos_b);
+    csa(&twos_a, &s->ones, s->ones, v[4], v[5]);
+    csa(&twos_b, &s->ones, s->ones, v[6], v[7]);
+    csa(&fours_b, &s->twos, s->twos, twos_a, twos_b);
+    csa(&eights_a, &s->fours, s->fours, fours_a, fours_b);
+    csa(&twos_a, &s->ones, s->ones, v[8], v[9]);
+    csa(&twos_b, &s->ones, s->ones, v[10], v[11]);
+    csa(&fours_a, &s->twos, s->twos, twos_a, twos_b);
+    csa(&twos_a, &s->ones, s->ones, v[12], v[13]);
+    csa(&twos_b, &s->ones, s->ones, v[14], v[15]);
+    csa(&fours_b, &s->twos, s->twos, twos_a, twos_b);
+    csa(&eights_b, &s->fours, s->fours, fours_a, fours_b);
+    csa(&sixteens, &s->eights, s->eights, eights_a, eights_b);
+    s->total = _mm256_add_epi64(s->total, popcount256(sixteens));
+}
+
+static inline int64_t hs_finish(hs_acc *s)
+{
+    __m256i total = _mm256_slli_epi64(s->total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(s->eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(s->fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(s->twos), 1));
+    total = _mm256_add_epi64(total, popcount256(s->ones));
+    return hsum256(total);
+}
+
+static inline __m256i load_plane(const qtype *p)
+{
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+int popcount_xor_avx2(const qtype *a, const qtype *b, int n)
+{
+    int i = 0;
+    hs_acc s;
+    hs_init(&s);
+    __m256i v[HS_BLOCK];
+    for (; i + HS_BLOCK * QPER256 <= n; i += HS_BLOCK * QPER256)
+    {
+        for (int j = 0; j < HS_BLOCK; j++)
+        {
+            v[j] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i + j * QPER256)),
+                                    _mm256_loadu_si256((const __m256i *)(b + i + j * QPER256)));
+        }
+        hs_block(&s, v);
+    }
+    __m256i rest = _mm256_setzero_si256();
+    for (; i + QPER256 <= n; i += QPER256)
+    {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        rest = _mm256_add_epi64(rest, popcount256(x));
+    }
+    return (int)(hs_finish(&s) + hsum256(rest) + xor_words(a, b, i, n));
+}
+
+/*
+ * The ternary kernels read planar operands: each plane of a tblock is one ymm register, so
+ * no deinterleaving or weight permutation is needed. Partial trailing blocks go through
+ * the scalar word loops.
+ */
+static inline __m256i tbn_vec(const qtype *w, const tblock *in)
+{
+    return _mm256_and_si256(load_plane(in->nz), _mm256_xor_si256(load_plane(in->sign), load_plane(w)));
+}
+
+int popcount_tbn_avx2(const qtype *w, const tblock *in, int n)
+{
+    int i = 0;
+    hs_acc s;
+    hs_init(&s);
+    __m256i v[HS_BLOCK];
+    for (; i + HS_BLOCK * TBLOCK_WORDS <= n; i += HS_BLOCK * TBLOCK_WORDS)
+    {
+        for (int j = 0; j < HS_BLOCK; j++)
+        {
+            v[j] = tbn_vec(w + i + j * TBLOCK_WORDS, in + i / TBLOCK_WORDS + j);
+        }
+        hs_block(&s, v);
+    }
+    __m256i rest = _mm256_setzero_si256();
+    for (; i + TBLOCK_WORDS <= n; i += TBLOCK_WORDS)
+    {
+        rest = _mm256_add_epi64(rest, popcount256(tbn_vec(w + i, in + i / TBLOCK_WORDS)));
+    }
+    return (int)(hs_finish(&s) + hsum256(rest) + tbn_words(w, in, i, n));
+}
+
+int popcount_tnn_avx2(const tblock *w, const tblock *in, int n)
+{
+    int i = 0;
+    hs_acc nonzero, minus;
+    hs_init(&nonzero);
+    hs_init(&minus);
+    __m256i vn[HS_BLOCK], vm[HS_BLOCK];
+    for (; i + HS_BLOCK * TBLOCK_WORDS <= n; i += HS_BLOCK * TBLOCK_WORDS)
+    {
+        for (int j = 0; j < HS_BLOCK; j++)
+        {
+            const tblock *a = in + i / TBLOCK_WORDS + j;
+            const tblock *b = w + i / TBLOCK_WORDS + j;
+            vn[j] = _mm256_and_si256(load_plane(a->nz), load_plane(b->nz));
+            vm[j] = _mm256_and_si256(vn[j], _mm256_xor_si256(load_plane(a->sign), load_plane(b->sign)));
+        }
+        hs_block(&nonzero, vn);
+        hs_block(&minus, vm);
+    }
+    __m256i rest = _mm256_setzero_si256();
+    for (; i + TBLOCK_WORDS <= n; i += TBLOCK_WORDS)
+    {
+        const tblock *a = in + i / TBLOCK_WORDS;
+        const tblock *b = w + i / TBLOCK_WORDS;
+        __m256i both = _mm256_and_si256(load_plane(a->nz), load_plane(b->nz));
+        __m256i m = _mm256_and_si256(both, _mm256_xor_si256(load_plane(a->sign), load_plane(b->sign)));
+        rest = _mm256_add_epi64(rest, _mm256_sub_epi64(popcount256(both), _mm256_slli_epi64(popcount256(m), 1)));
+    }
+    return (int)(hs_finish(&nonzero) - 2 * hs_finish(&minus) + hsum256(rest) + tnn_words(w, in, i, n));
+}
+#pragma GCC pop_options
+#endif // QCAD_X86
+
+/**
+ * @brief Number of set bits in a[i] ^ b[i] for i in [0, n).
+ */
+int popcount_xor(const qtype *a, const qtype *b, int n)
+{
+    return qcad_get_kernels()->popcount_xor(a, b, n);
+}
+
+/**
+ * @brief Number of positive products of binary weights (bit 1 = +1) with ternary
+ *        activations. The signed dot product is 2 * popcount_tbn - popcount_nonzero(in).
+ */
+int popcount_tbn(const qtype *w, const tblock *in, int n)
+{
+    return qcad_get_kernels()->popcount_tbn(w, in, n);
+}
+
+/**
+ * @brief Number of nonzero ternary activations in words [0, n).
+ */
+int popcount_nonzero(const tblock *in, int n)
+{
+    return (int)nonzero_words(in, 0, n);
+}
+
+/**
+ * @brief Signed dot product of planar ternary weights (see bgemm_planar_tnn) with ternary
+ *        activations.
+ */
+int popcount_tnn(const tblock *w, const tblock *in, int n)
+{
+    return qcad_get_kernels()->popcount_tnn(w, in, n);
+}
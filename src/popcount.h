@@ -0,0 +1,127 @@
+#ifndef POPCOUNT_H
+#define POPCOUNT_H
+#include "utils.h"
+#include <stdint.h>
+
+/*
+ * Popcount reductions over packed word streams, forwarded to the variant picked by
+ * dispatch.c. The AVX2 variant uses a vpshufb nibble lookup with vpsadbw and Harley-Seal
+ * carry-save accumulation over blocks of 16 vectors, the SSE4.2 variant uses popcnt per
+ * word and the scalar one the compiler's generic popcount.
+ */
+int popcount_xor(const qtype *a, const qtype *b, int n);
+int popcount_tbn(const qtype *w, const tblock *in, int n);
+int popcount_tnn(const tblock *w, const tblock *in, int n);
+int popcount_nonzero(const tblock *in, int n);
+
+/*
+ * Word-level reductions over words [i, n). They are inlined into every caller, so the builtin
+ * expands to popcnt inside functions compiled for a popcnt target.
+ */
+static inline int qpop(qtype x)
+{
+#if defined(QVECTOR)
+    int cnt = 0;
+    for (int l = 0; l < QLANES; l++)
+    {
+        cnt += __builtin_popcountll(x[l]);
+    }
+    return cnt;
+#elif QWORD_BITS == 64
+    return __builtin_popcountll(x);
+#else
+    return __builtin_popcount(x);
+#endif
+}
+
+static inline int64_t xor_words(const qtype *a, const qtype *b, int i, int n)
+{
+    int64_t cnt = 0;
+    for (; i < n; i++)
+    {
+        cnt += qpop(a[i] ^ b[i]);
+    }
+    return cnt;
+}
+
+/*
+ * Ternary products with the nz / sign encoding of ttype. A product is nonzero where both
+ * nz masks are set and negative where the signs differ, so
+ *     dot = popcount(nz_a & nz_w) - 2 * popcount(nz_a & nz_w & (s_a ^ s_w)).
+ * TBN weights are all nonzero and their bit is 1 for +1, i.e. the complement of a sign, so
+ * the dot reduces to 2 * popcount(nz_a & (s_a ^ w)) - popcount(nz_a). The second term only
+ * depends on the activations and is computed once per activation vector, which leaves one
+ * popcount per weight word (tbn_words counts the first term only). TNN weights (w1 = +1,
+ * w0 = -1) give nz_w = w0 | w1 and s_w = w0, which bgemm_planar_tnn and bgemm_prepack_tnn
+ * store directly.
+ *
+ * The word reductions take planar operands (see bgemm.h) and word indices.
+ */
+static inline int64_t tbn_words(const qtype *w, const tblock *in, int i, int n)
+{
+    int64_t cnt = 0;
+    for (; i < n; i++)
+    {
+        const tblock *a = in + i / TBLOCK_WORDS;
+        int l = i % TBLOCK_WORDS;
+        cnt += qpop(a->nz[l] & (a->sign[l] ^ w[i]));
+    }
+    return cnt;
+}
+
+static inline int64_t nonzero_words(const tblock *in, int i, int n)
+{
+    int64_t cnt = 0;
+    for (; i < n; i++)
+    {
+        cnt += qpop(in[i / TBLOCK_WORDS].nz[i % TBLOCK_WORDS]);
+    }
+    return cnt;
+}
+
+static inline int64_t tnn_words(const tblock *w, const tblock *in, int i, int n)
+{
+    int64_t cnt = 0;
+    for (; i < n; i++)
+    {
+        const tblock *a = in + i / TBLOCK_WORDS;
+        const tblock *b = w + i / TBLOCK_WORDS;
+        int l = i % TBLOCK_WORDS;
+        qtype both = a->nz[l] & b->nz[l];
+        cnt += qpop(both) - 2 * qpop(both & (a->sign[l] ^ b->sign[l]));
+    }
+    return cnt;
+}
+
+/*
+ * Blocked variants for prepacked weights (see bgemm_prepack and bgemm_prepack_tnn): one
+ * activation word against the r words of r output channels stored next to each other
+ * (TNN: r nz words, then r sign words). The input word is loaded once and the r popcount
+ * chains are independent.
+ */
+static inline void xor_block(int64_t *sum, int r, const qtype *w, qtype a)
+{
+    for (int j = 0; j < r; j++)
+    {
+        sum[j] += qpop(a ^ w[j]);
+    }
+}
+
+static inline void tbn_block(int64_t *sum, int r, const qtype *w, ttype a)
+{
+    int64_t nonzero = qpop(a.nz);
+    for (int j = 0; j < r; j++)
+    {
+        sum[j] += 2 * qpop(a.nz & (a.sign ^ w[j])) - nonzero;
+    }
+}
+
+static inline void tnn_block(int64_t *sum, int r, const qtype *w, ttype a)
+{
+    for (int j = 0; j < r; j++)
+    {
+        qtype both = a.nz & w[j];
+        sum[j] += qpop(both) - 2 * qpop(both & (a.sign ^ w[r + j]));
+    }
+}
+#endif // POPCOUNT_H
@@ -0,0 +1,374 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-09-27 14:05:12
+ * @ Modified time: 2024-09-27 14:05:12
+ * @ Description: Cache-blocked SGEMM with an AVX2/FMA micro-kernel for the FP layers.
+ */
+
+#include "sgemm.h"
+#include "dispatch.h"
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef QCAD_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Adds an (mr x nr) corner of a full micro-tile to C.
+ */
+static inline void add_tile(const float *tile, int mr, int nr, float *C, int ldc)
+{
+    for (int i = 0; i < mr; i++)
+    {
+        for (int j = 0; j < nr; j++)
+        {
+            C[i * ldc + j] += tile[i * SGEMM_NR + j];
+        }
+    }
+}
+
+/*
+ * Micro-kernels: C[0:mr][0:nr] += Ap * Bp over kc, where Ap holds SGEMM_MR floats and Bp
+ * SGEMM_NR floats per k (see pack_a / pack_b; edge panels are zero-padded).
+ */
+void sgemm_kernel_scalar(int kc, const float *Ap, const float *Bp, float *C, int ldc, int mr, int nr)
+{
+    float tile[SGEMM_MR * SGEMM_NR] = {0};
+    for (int k = 0; k < kc; k++)
+    {
+        for (int i = 0; i < SGEMM_MR; i++)
+        {
+            float a = Ap[k * SGEMM_MR + i];
+            for (int j = 0; j < SGEMM_NR; j++)
+            {
+                tile[i * SGEMM_NR + j] += a * Bp[k * SGEMM_NR + j];
+            }
+        }
+    }
+    add_tile(tile, mr, nr, C, ldc);
+}
+
+#ifdef QCAD_X86
+__attribute__((target("avx2,fma"))) void sgemm_kernel_avx2(int kc, const float *Ap, const float *Bp, float *C, int ldc, int mr, int nr)
+{
+    // 6 x 16 tile in 12 accumulators, 2 B vectors and 1 broadcast A register
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    for (int k = 0; k < kc; k++)
+    {
+        __m256 b0 = _mm256_load_ps(Bp);
+        __m256 b1 = _mm256_load_ps(Bp + 8);
+        __m256 a;
+        a = _mm256_broadcast_ss(Ap + 0);
+        c00 = _mm256_fmadd_ps(a, b0, c00);
+        c01 = _mm256_fmadd_ps(a, b1, c01);
+        a = _mm256_broadcast_ss(Ap + 1);
+        c10 = _mm256_fmadd_ps(a, b0, c10);
+        c11 = _mm256_fmadd_ps(a, b1, c11);
+        a = _mm256_broadcast_ss(Ap + 2);
+        c20 = _mm256_fmadd_ps(a, b0, c20);
+        c21 = _mm256_fmadd_ps(a, b1, c21);
+        a = _mm256_broadcast_ss(Ap + 3);
+        c30 = _mm256_fmadd_ps(a, b0, c30);
+        c31 = _mm256_fmadd_ps(a, b1, c31);
+        a = _mm256_broadcast_ss(Ap + 4);
+        c40 = _mm256_fmadd_ps(a, b0, c40);
+        c41 = _mm256_fmadd_ps(a, b1, c41);
+        a = _mm256_broadcast_ss(Ap + 5);
+        c50 = _mm256_fmadd_ps(a, b0, c50);
+        c51 = _mm256_fmadd_ps(a, b1, c51);
+        Ap += SGEMM_MR;
+        Bp += SGEMM_NR;
+    }
+    __m256 acc[SGEMM_MR][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+    if (mr == SGEMM_MR && nr == SGEMM_NR)
+    {
+        for (int i = 0; i < SGEMM_MR; i++)
+        {
+            float *c = C + i * ldc;
+            _mm256_storeu_ps(c, _mm256_add_ps(_mm256_loadu_ps(c), acc[i][0]));
+            _mm256_storeu_ps(c + 8, _mm256_add_ps(_mm256_loadu_ps(c + 8), acc[i][1]));
+        }
+        return;
+    }
+    float tile[SGEMM_MR * SGEMM_NR];
+    for (int i = 0; i < SGEMM_MR; i++)
+    {
+        _mm256_storeu_ps(tile + i * SGEMM_NR, acc[i][0]);
+        _mm256_storeu_ps(tile + i * SGEMM_NR + 8, acc[i][1]);
+    }
+    add_tile(tile, mr, nr, C, ldc);
+}
+#endif
+
+/**
+ * @brief Packs an (mc x kc) block of A into SGEMM_MR-row panels, k-major within a panel.
+ */
+static void pack_a(int mc, int kc, const float *A, int lda, float *Ap)
+{
+    for (int i0 = 0; i0 < mc; i0 += SGEMM_MR)
+    {
+        int mr = (mc - i0 < SGEMM_MR) ? mc - i0 : SGEMM_MR;
+        for (int k = 0; k < kc; k++)
+        {
+            for (int i = 0; i < SGEMM_MR; i++)
+            {
+                *Ap++ = (i < mr) ? A[(size_t)(i0 + i) * lda + k] : 0.0f;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Packs a (kc x nc) block of B into SGEMM_NR-column panels, k-major within a panel.
+ */
+static void pack_b(int kc, int nc, const float *B, int ldb, float *Bp)
+{
+    for (int j0 = 0; j0 < nc; j0 += SGEMM_NR)
+    {
+        int nr = (nc - j0 < SGEMM_NR) ? nc - j0 : SGEMM_NR;
+        for (int k = 0; k < kc; k++)
+        {
+            const float *b = B + (size_t)k * ldb + j0;
+            if (nr == SGEMM_NR)
+            {
+                memcpy(Bp, b, SGEMM_NR * sizeof(float));
+            }
+            else
+            {
+                memcpy(Bp, b, nr * sizeof(float));
+                memset(Bp + nr, 0, (SGEMM_NR - nr) * sizeof(float));
+            }
+            Bp += SGEMM_NR;
+        }
+    }
+}
+
+static void *alloc_panel(size_t count)
+{
+    void *panel = aligned_alloc(32, ((count * sizeof(float) + 31) / 32) * 32);
+    if (panel == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed for sgemm panel\n");
+        exit(1);
+    }
+    return panel;
+}
+
+typedef struct
+{
+    void (*kernel)(int, const float *, const float *, float *, int, int, int);
+    int M, nc, kc, pc, jc;
+    const float *A;
+    int lda;
+    const float *Bp;
+    float *C;
+    int ldc;
+} sgemm_panel_job;
+
+/**
+ * @brief Packs and multiplies the SGEMM_MC-row blocks [begin, end) of A against the packed
+ *        panel of B.
+ */
+static void sgemm_row_blocks(void *arg, int begin, int end)
+{
+    const sgemm_panel_job *job = (const sgemm_panel_job *)arg;
+    int kc = job->kc, nc = job->nc;
+    float *Ap = (float *)alloc_panel((size_t)SGEMM_MC * SGEMM_KC);
+    for (int ic = begin * SGEMM_MC; ic < job->M && ic < end * SGEMM_MC; ic += SGEMM_MC)
+    {
+        int mc = (job->M - ic < SGEMM_MC) ? job->M - ic : SGEMM_MC;
+        pack_a(mc, kc, job->A + (size_t)ic * job->lda + job->pc, job->lda, Ap);
+        for (int jr = 0; jr < nc; jr += SGEMM_NR)
+        {
+            int nr = (nc - jr < SGEMM_NR) ? nc - jr : SGEMM_NR;
+            for (int ir = 0; ir < mc; ir += SGEMM_MR)
+            {
+                int mr = (mc - ir < SGEMM_MR) ? mc - ir : SGEMM_MR;
+                job->kernel(kc, Ap + (size_t)ir * kc, job->Bp + (size_t)jr * kc,
+                            job->C + (size_t)(ic + ir) * job->ldc + job->jc + jr, job->ldc, mr, nr);
+            }
+        }
+    }
+    free(Ap);
+}
+
+/**
+ * @brief C = A * B in single precision.
+ *
+ * Loops follow the usual five-level blocking: NC columns of B and KC of depth are packed
+ * once, then every MC-row block of A is packed and swept by the micro-kernel. The MC blocks
+ * are independent and are split over the thread pool.
+ *
+ * @param M Rows of A and C.
+ * @param N Columns of B and C.
+ * @param K Columns of A, rows of B.
+ * @param C Output, row stride ldc. It is overwritten.
+ */
+void sgemm(int M, int N, int K, const float *A, int lda, const float *B, int ldb, float *C, int ldc)
+{
+    void (*kernel)(int, const float *, const float *, float *, int, int, int) = qcad_get_kernels()->sgemm_kernel;
+    for (int i = 0; i < M; i++)
+    {
+        memset(C + (size_t)i * ldc, 0, N * sizeof(float));
+    }
+    int ncmax = (N < SGEMM_NC) ? N : SGEMM_NC;
+    float *Bp = (float *)alloc_panel((size_t)SGEMM_KC * ((ncmax + SGEMM_NR - 1) / SGEMM_NR) * SGEMM_NR);
+
+    for (int jc = 0; jc < N; jc += SGEMM_NC)
+    {
+        int nc = (N - jc < SGEMM_NC) ? N - jc : SGEMM_NC;
+        for (int pc = 0; pc < K; pc += SGEMM_KC)
+        {
+            int kc = (K - pc < SGEMM_KC) ? K - pc : SGEMM_KC;
+            pack_b(kc, nc, B + (size_t)pc * ldb + jc, ldb, Bp);
+            sgemm_panel_job job = {kernel, M, nc, kc, pc, jc, A, lda, Bp, C, ldc};
+            qcad_parallel_for((M + SGEMM_MC - 1) / SGEMM_MC, 1, sgemm_row_blocks, &job);
+        }
+    }
+    free(Bp);
+}
+
+/*
+ * GEMV kernels: y[0:rows] = A[0:rows] x for rows <= SGEMV_ROWS.
+ */
+void sgemv_kernel_scalar(int rows, int K, const float *A, int lda, const float *x, float *y)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        const float *a = A + (size_t)r * lda;
+        float s0 = 0.0f, s1 = 0.0f;
+        int k = 0;
+        for (; k + 1 < K; k += 2)
+        {
+            s0 += a[k] * x[k];
+            s1 += a[k + 1] * x[k + 1];
+        }
+        for (; k < K; k++)
+        {
+            s0 += a[k] * x[k];
+        }
+        y[r] = s0 + s1;
+    }
+}
+
+#ifdef QCAD_X86
+__attribute__((target("avx2,fma"))) static inline float hsum256_ps(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+#define SGEMV_PREFETCH 512 // floats ahead, 2 KB per row
+
+__attribute__((target("avx2,fma"))) static float sgemv_row_avx2(int K, const float *a, const float *x)
+{
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    int k = 0;
+    for (; k + 16 <= K; k += 16)
+    {
+        _mm_prefetch((const char *)(a + k + SGEMV_PREFETCH), _MM_HINT_NTA);
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(x + k), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k + 8), _mm256_loadu_ps(x + k + 8), s1);
+    }
+    float sum = hsum256_ps(_mm256_add_ps(s0, s1));
+    for (; k < K; k++)
+    {
+        sum += a[k] * x[k];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) void sgemv_kernel_avx2(int rows, int K, const float *A, int lda, const float *x, float *y)
+{
+    if (rows != SGEMV_ROWS)
+    {
+        for (int r = 0; r < rows; r++)
+        {
+            y[r] = sgemv_row_avx2(K, A + (size_t)r * lda, x);
+        }
+        return;
+    }
+    const float *a0 = A, *a1 = A + lda, *a2 = A + 2 * (size_t)lda, *a3 = A + 3 * (size_t)lda;
+    __m256 s00 = _mm256_setzero_ps(), s01 = _mm256_setzero_ps();
+    __m256 s10 = _mm256_setzero_ps(), s11 = _mm256_setzero_ps();
+    __m256 s20 = _mm256_setzero_ps(), s21 = _mm256_setzero_ps();
+    __m256 s30 = _mm256_setzero_ps(), s31 = _mm256_setzero_ps();
+    int k = 0;
+    for (; k + 16 <= K; k += 16)
+    {
+        _mm_prefetch((const char *)(a0 + k + SGEMV_PREFETCH), _MM_HINT_NTA);
+        _mm_prefetch((const char *)(a1 + k + SGEMV_PREFETCH), _MM_HINT_NTA);
+        _mm_prefetch((const char *)(a2 + k + SGEMV_PREFETCH), _MM_HINT_NTA);
+        _mm_prefetch((const char *)(a3 + k + SGEMV_PREFETCH), _MM_HINT_NTA);
+        __m256 x0 = _mm256_loadu_ps(x + k);
+        __m256 x1 = _mm256_loadu_ps(x + k + 8);
+        s00 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + k), x0, s00);
+        s01 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + k + 8), x1, s01);
+        s10 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + k), x0, s10);
+        s11 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + k + 8), x1, s11);
+        s20 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + k), x0, s20);
+        s21 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + k + 8), x1, s21);
+        s30 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + k), x0, s30);
+        s31 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + k + 8), x1, s31);
+    }
+    float sum[SGEMV_ROWS] = {hsum256_ps(_mm256_add_ps(s00, s01)), hsum256_ps(_mm256_add_ps(s10, s11)),
+                             hsum256_ps(_mm256_add_ps(s20, s21)), hsum256_ps(_mm256_add_ps(s30, s31))};
+    for (; k < K; k++)
+    {
+        sum[0] += a0[k] * x[k];
+        sum[1] += a1[k] * x[k];
+        sum[2] += a2[k] * x[k];
+        sum[3] += a3[k] * x[k];
+    }
+    for (int r = 0; r < SGEMV_ROWS; r++)
+    {
+        y[r] = sum[r];
+    }
+}
+#endif
+
+typedef struct
+{
+    void (*kernel)(int, int, const float *, int, const float *, float *);
+    int M, K;
+    const float *A;
+    int lda;
+    const float *x;
+    float *y;
+} sgemv_job;
+
+static void sgemv_row_blocks(void *arg, int begin, int end)
+{
+    const sgemv_job *job = (const sgemv_job *)arg;
+    for (int m0 = begin * SGEMV_BLOCK; m0 < job->M && m0 < end * SGEMV_BLOCK; m0 += SGEMV_BLOCK)
+    {
+        int last = (job->M - m0 < SGEMV_BLOCK) ? job->M : m0 + SGEMV_BLOCK;
+        for (int m = m0; m < last; m += SGEMV_ROWS)
+        {
+            int rows = (last - m < SGEMV_ROWS) ? last - m : SGEMV_ROWS;
+            job->kernel(rows, job->K, job->A + (size_t)m * job->lda, job->lda, job->x, job->y + m);
+        }
+    }
+}
+
+/**
+ * @brief y = A x in single precision, A (M x K) row-major with row stride lda.
+ *
+ * Blocks of SGEMV_BLOCK rows are split over the thread pool; a memory-bound GEMV needs
+ * several cores to reach DRAM bandwidth.
+ */
+void sgemv(int M, int K, const float *A, int lda, const float *x, float *y)
+{
+    sgemv_job job = {qcad_get_kernels()->sgemv_kernel, M, K, A, lda, x, y};
+    qcad_parallel_for((M + SGEMV_BLOCK - 1) / SGEMV_BLOCK, 1, sgemv_row_blocks, &job);
+}
@@ -0,0 +1,28 @@
+#ifndef SGEMM_H
+#define SGEMM_H
+
+/*
+ * Single precision GEMM for the FP layers.
+ *
+ * All matrices are row-major: C (M x N) = A (M x K) * B (K x N). A and B are packed into
+ * cache-sized panels and multiplied by an SGEMM_MR x SGEMM_NR register-blocked micro-kernel
+ * (AVX2/FMA when available, see dispatch.c).
+ */
+#define SGEMM_MR 6    // rows of C per micro-kernel call
+#define SGEMM_NR 16   // columns of C per micro-kernel call, two 8-float vectors
+#define SGEMM_MC 72   // rows of A packed per block (L2)
+#define SGEMM_KC 256  // depth of a packed block
+#define SGEMM_NC 3072 // columns of B packed per block (L3)
+
+/*
+ * Single precision GEMV y = A x for the FP linear layers. A is streamed once, so the
+ * kernel works on SGEMV_ROWS rows at a time (one load of x feeds all of them), keeps two
+ * independent FMA chains per row and prefetches A non-temporally to keep it out of the
+ * caches that hold x.
+ */
+#define SGEMV_ROWS 4
+#define SGEMV_BLOCK 64 // rows per parallel work item
+
+void sgemm(int M, int N, int K, const float *A, int lda, const float *B, int ldb, float *C, int ldc);
+void sgemv(int M, int K, const float *A, int lda, const float *x, float *y);
+#endif // SGEMM_H
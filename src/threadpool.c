@@ -0,0 +1,580 @@
+/**
+ * @ Author: Hai Phu
+ * @ Email:  haiphu@hcmut.edu.vn
+ * @ Create Time: 2024-10-14 09:12:40
+ * @ Modified time: 2024-10-18 10:26:13
+ * @ Description: Persistent spin-then-park worker pool with a work-stealing scheduler.
+ */
+
+#include "threadpool.h"
+#include "dispatch.h"
+#include "numa.h"
+#include "affinity.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_MAX_THREADS 256
+#define POOL_MAX_JOBS 16         // parallel regions in flight at once, from different threads
+#define POOL_CHUNKS_PER_THREAD 8 // tasks per thread a region is cut into
+#define POOL_SPIN 20000          // polls of the job counter before a waiting thread parks or yields
+
+/*
+ * The deque of one thread in one region: the unclaimed chunks [begin, end), packed into one
+ * word so that the owner (taking begin) and thieves (taking the upper half) both claim work
+ * with a single compare-and-swap. Each deque has its own cache line.
+ */
+typedef struct
+{
+    _Alignas(64) atomic_ullong range;
+} pool_deque;
+
+typedef struct
+{
+    qcad_task_fn fn;
+    void *ctx;
+    int n;       // items
+    int chunk;   // items per task
+    int ndeques; // threads per group when the region started
+    int group;   // group whose workers serve the region
+    pool_deque *deques;
+    atomic_int users; // workers inside the region, the caller excluded
+} pool_job;
+
+typedef struct
+{
+    pthread_t thread;
+    int group;
+    int lane; // deque of the worker in the regions of its group, 1 .. group_threads - 1
+} pool_worker;
+
+static struct
+{
+    pthread_rwlock_t resize; // read-held by running regions, write-held while the pool is resized
+    pthread_mutex_t lock;    // guards jobs, sleepers and parking
+    pthread_cond_t wake;
+    int sleepers;
+    qcad_config config;
+    char cpulist[256]; // config.cpus
+    int ncpus;
+    int cpus[QCAD_MAX_CPUS]; // usable CPUs
+    int nthreads;      // ngroups * group_threads, the calling threads (lane 0) included
+    int group_threads; // threads a region runs on
+    int ngroups;
+    unsigned epoch; // bumped by every reconfiguration, invalidates the groups of calling threads
+    atomic_uint next_group;
+    unsigned spawn_generation;
+    int nworkers;
+    pool_worker workers[POOL_MAX_THREADS];
+    pool_job *jobs[POOL_MAX_JOBS];
+    atomic_uint generation; // bumped when a region starts and on shutdown
+    atomic_int stop; // set while the workers are being stopped, read by them without the lock
+} pool = {.resize = PTHREAD_RWLOCK_INITIALIZER, .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static __thread int in_region; // nested regions run inline
+static __thread int caller_group_id;
+static __thread unsigned caller_epoch; // pool.epoch when caller_group_id was handed out
+static __thread int caller_pinned;
+
+static inline void cpu_relax(void)
+{
+#ifdef QCAD_X86
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline unsigned long long pack_range(unsigned begin, unsigned end)
+{
+    return ((unsigned long long)begin << 32) | end;
+}
+
+/**
+ * @brief Runs chunk c of a region.
+ */
+static void run_chunk(const pool_job *job, unsigned c)
+{
+    int begin = (int)c * job->chunk;
+    int end = (job->n - begin < job->chunk) ? job->n : begin + job->chunk;
+    job->fn(job->ctx, begin, end);
+}
+
+/**
+ * @brief Takes the first chunk of deque self. Returns 0 when it is empty.
+ */
+static int pop_chunk(pool_job *job, int self, unsigned *c)
+{
+    atomic_ullong *range = &job->deques[self].range;
+    unsigned long long r = atomic_load_explicit(range, memory_order_relaxed);
+    for (;;)
+    {
+        unsigned begin = (unsigned)(r >> 32), end = (unsigned)r;
+        if (begin >= end)
+        {
+            return 0;
+        }
+        if (atomic_compare_exchange_weak_explicit(range, &r, pack_range(begin + 1, end), memory_order_acquire,
+                                                  memory_order_relaxed))
+        {
+            *c = begin;
+            return 1;
+        }
+    }
+}
+
+/**
+ * @brief Moves the upper half of another thread's deque into the (empty) deque self.
+ *
+ * Victims are scanned from a per-thread position so concurrent thieves spread out. Returns 0
+ * when every deque is empty, i.e. all chunks have been claimed.
+ */
+static int steal_chunks(pool_job *job, int self, unsigned *seed)
+{
+    *seed = *seed * 1103515245u + 12345u;
+    int first = (int)((*seed >> 16) % (unsigned)job->ndeques);
+    for (int k = 0; k < job->ndeques; k++)
+    {
+        int victim = (first + k) % job->ndeques;
+        if (victim == self)
+        {
+            continue;
+        }
+        atomic_ullong *range = &job->deques[victim].range;
+        unsigned long long r = atomic_load_explicit(range, memory_order_relaxed);
+        for (;;)
+        {
+            unsigned begin = (unsigned)(r >> 32), end = (unsigned)r;
+            if (begin >= end)
+            {
+                break;
+            }
+            unsigned mid = begin + (end - begin) / 2;
+            if (atomic_compare_exchange_weak_explicit(range, &r, pack_range(begin, mid), memory_order_acquire,
+                                                      memory_order_relaxed))
+            {
+                atomic_store_explicit(&job->deques[self].range, pack_range(mid, end), memory_order_release);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs chunks of a region from deque self, stealing when it runs dry, until no
+ *        unclaimed chunk is left.
+ */
+static void work_on(pool_job *job, int self)
+{
+    unsigned seed = (unsigned)self * 2654435761u + 1;
+    unsigned c;
+    do
+    {
+        while (pop_chunk(job, self, &c))
+        {
+            run_chunk(job, c);
+        }
+    } while (steal_chunks(job, self, &seed));
+}
+
+/**
+ * @brief Picks a region of group with work left for a worker and registers the worker as
+ *        its user.
+ *
+ * The scan starts after the region the worker served last, so concurrent regions (e.g.
+ * inferences from different threads) share the workers instead of being served in turn.
+ */
+static pool_job *acquire_job(int group, int *cursor)
+{
+    pool_job *job = NULL;
+    pthread_mutex_lock(&pool.lock);
+    for (int k = 1; k <= POOL_MAX_JOBS && job == NULL; k++)
+    {
+        int slot = (*cursor + k) % POOL_MAX_JOBS;
+        pool_job *candidate = pool.jobs[slot];
+        if (candidate == NULL || candidate->group != group)
+        {
+            continue;
+        }
+        for (int d = 0; d < candidate->ndeques; d++)
+        {
+            unsigned long long r = atomic_load_explicit(&candidate->deques[d].range, memory_order_relaxed);
+            if ((unsigned)(r >> 32) < (unsigned)r)
+            {
+                job = candidate;
+                *cursor = slot;
+                atomic_fetch_add_explicit(&job->users, 1, memory_order_relaxed);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return job;
+}
+
+/**
+ * @brief Waits until the job counter moves past seen: spins first, then parks.
+ */
+static void wait_job(unsigned seen)
+{
+    for (int i = 0; i < POOL_SPIN; i++)
+    {
+        if (atomic_load_explicit(&pool.generation, memory_order_acquire) != seen)
+        {
+            return;
+        }
+        cpu_relax();
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.sleepers++;
+    while (atomic_load_explicit(&pool.generation, memory_order_acquire) == seen)
+    {
+        pthread_cond_wait(&pool.wake, &pool.lock);
+    }
+    pool.sleepers--;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/**
+ * @brief Sets the CPUs of the thread at lane of group: its own usable CPU when pinning, else
+ *        a node when weights are placed per node (see numa.h), else all usable CPUs.
+ *
+ * Groups take consecutive CPUs and, without pinning, consecutive threads share a node, so
+ * a group stays on few cores and the node-local weight copies it reads stay hot.
+ */
+static void place_thread(int group, int lane)
+{
+    int position = group * pool.group_threads + lane;
+    if (pool.config.pin)
+    {
+        qcad_pin_thread(&pool.cpus[position % pool.ncpus], 1);
+    }
+    else if (qcad_get_numa_policy() != QCAD_NUMA_OFF && qcad_numa_nodes() > 1)
+    {
+        qcad_numa_bind((int)((long long)position * qcad_numa_nodes() / pool.nthreads));
+    }
+    else
+    {
+        qcad_pin_thread(pool.cpus, pool.ncpus);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    const pool_worker *self = (const pool_worker *)arg;
+    int cursor = 0;
+    unsigned seen = pool.spawn_generation;
+    in_region = 1;
+    place_thread(self->group, self->lane);
+    for (;;)
+    {
+        pool_job *job = acquire_job(self->group, &cursor);
+        if (job != NULL)
+        {
+            work_on(job, self->lane);
+            atomic_fetch_sub_explicit(&job->users, 1, memory_order_release);
+            continue;
+        }
+        // seen was read before the scan, so a region registered since then is not missed
+        wait_job(seen);
+        seen = atomic_load_explicit(&pool.generation, memory_order_acquire);
+        if (atomic_load_explicit(&pool.stop, memory_order_acquire))
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Bumps the job counter and wakes the parked workers. Called with lock held.
+ */
+static void publish(void)
+{
+    atomic_fetch_add_explicit(&pool.generation, 1, memory_order_release);
+    if (pool.sleepers > 0)
+    {
+        pthread_cond_broadcast(&pool.wake);
+    }
+}
+
+/**
+ * @brief Stops the current workers and starts those of config. Called with resize
+ *        write-held (or from pool_init).
+ */
+static void pool_apply(const qcad_config *config)
+{
+    if (pool.nworkers > 0)
+    {
+        pthread_mutex_lock(&pool.lock);
+        atomic_store_explicit(&pool.stop, 1, memory_order_release);
+        publish();
+        pthread_mutex_unlock(&pool.lock);
+        for (int i = 0; i < pool.nworkers; i++)
+        {
+            pthread_join(pool.workers[i].thread, NULL);
+        }
+        atomic_store_explicit(&pool.stop, 0, memory_order_relaxed);
+    }
+    pool.config = *config;
+    if (config->cpus != NULL)
+    {
+        if (strlen(config->cpus) >= sizeof(pool.cpulist))
+        {
+            fprintf(stderr, "qcad_configure: cpulist too long\n");
+            exit(1);
+        }
+        if (config->cpus != pool.cpulist)
+        {
+            strcpy(pool.cpulist, config->cpus);
+        }
+        pool.config.cpus = pool.cpulist;
+    }
+    pool.ncpus = qcad_usable_cpus(pool.config.cpus, pool.config.avoid_smt, pool.cpus, QCAD_MAX_CPUS);
+    if (pool.ncpus == 0)
+    {
+        fprintf(stderr, "qcad_configure: no usable CPU in '%s'\n", pool.config.cpus);
+        exit(1);
+    }
+
+    int n = pool.config.threads;
+    if (n <= 0)
+    {
+        int limit = qcad_cgroup_cpu_limit();
+        n = (limit > 0 && limit < pool.ncpus) ? limit : pool.ncpus;
+    }
+    n = (n > POOL_MAX_THREADS) ? POOL_MAX_THREADS : n;
+    int group = n;
+    if (pool.config.mode == QCAD_THROUGHPUT)
+    {
+        group = (pool.config.group_threads > 0) ? pool.config.group_threads : 1;
+        group = (group < n) ? group : n;
+    }
+    pool.group_threads = group;
+    pool.ngroups = n / group;
+    pool.nthreads = pool.ngroups * group;
+    pool.epoch++;
+    pool.spawn_generation = atomic_load(&pool.generation);
+    pool.nworkers = 0;
+    for (int g = 0; g < pool.ngroups; g++)
+    {
+        for (int lane = 1; lane < group; lane++)
+        {
+            pool_worker *worker = &pool.workers[pool.nworkers];
+            worker->group = g;
+            worker->lane = lane;
+            // A missing worker only slows its group down: its chunks are stolen by the others
+            if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+            {
+                fprintf(stderr, "qcad: could only start %d worker threads\n", pool.nworkers);
+                return;
+            }
+            pool.nworkers++;
+        }
+    }
+}
+
+static int env_int(const char *name)
+{
+    const char *env = getenv(name);
+    return (env != NULL && atoi(env) > 0) ? atoi(env) : 0;
+}
+
+/**
+ * @brief The configuration given by the environment (see threadpool.h).
+ */
+static qcad_config env_config(void)
+{
+    qcad_config config = {QCAD_LATENCY, env_int("QCAD_NUM_THREADS"), env_int("QCAD_GROUP_THREADS"),
+                          env_int("QCAD_PIN"), env_int("QCAD_AVOID_SMT"), getenv("QCAD_CPUS")};
+    const char *mode = getenv("QCAD_MODE");
+    if (mode != NULL)
+    {
+        if (strcmp(mode, "throughput") == 0)
+            config.mode = QCAD_THROUGHPUT;
+        else if (strcmp(mode, "latency") != 0)
+            fprintf(stderr, "qcad: unknown QCAD_MODE '%s' ignored\n", mode);
+    }
+    return config;
+}
+
+static void pool_init(void)
+{
+    qcad_config config = env_config();
+    pool_apply(&config);
+}
+
+/**
+ * @brief Group of the calling thread, handed out round-robin at its first region after each
+ *        reconfiguration.
+ *
+ * In throughput mode with pinning the thread is pinned to the first CPU of its group, so an
+ * application thread per group runs one inference per group of cores. In latency mode the
+ * caller is left alone and shares the first usable CPU with no worker.
+ */
+static int caller_group(void)
+{
+    if (caller_epoch == pool.epoch)
+    {
+        return caller_group_id;
+    }
+    caller_epoch = pool.epoch;
+    caller_group_id = (int)(atomic_fetch_add_explicit(&pool.next_group, 1, memory_order_relaxed) % (unsigned)pool.ngroups);
+    if (pool.config.pin && pool.config.mode == QCAD_THROUGHPUT)
+    {
+        place_thread(caller_group_id, 0);
+        caller_pinned = 1;
+    }
+    else if (caller_pinned)
+    {
+        qcad_pin_thread(pool.cpus, pool.ncpus);
+        caller_pinned = 0;
+    }
+    return caller_group_id;
+}
+
+/**
+ * @brief Reconfigures the pool (see qcad_config). Waits for running regions to finish; it
+ *        must not be called from inside a parallel region.
+ */
+void qcad_configure(const qcad_config *config)
+{
+    if (in_region)
+    {
+        fprintf(stderr, "qcad_configure: called from a parallel region\n");
+        exit(1);
+    }
+    if ((config->mode != QCAD_LATENCY && config->mode != QCAD_THROUGHPUT) || config->threads < 0 ||
+        config->group_threads < 0)
+    {
+        fprintf(stderr, "qcad_configure: invalid configuration\n");
+        exit(1);
+    }
+    pthread_once(&pool_once, pool_init);
+    pthread_rwlock_wrlock(&pool.resize);
+    pool_apply(config);
+    pthread_rwlock_unlock(&pool.resize);
+}
+
+/**
+ * @brief Returns the current configuration, taken from the environment when the pool was
+ *        not configured yet. cpus stays valid until the next reconfiguration.
+ */
+void qcad_get_config(qcad_config *config)
+{
+    pthread_once(&pool_once, pool_init);
+    pthread_rwlock_rdlock(&pool.resize);
+    *config = pool.config;
+    pthread_rwlock_unlock(&pool.resize);
+}
+
+/**
+ * @brief Sets the total number of threads, the callers included, keeping the rest of the
+ *        configuration.
+ *
+ * n <= 0 restores the default (QCAD_NUM_THREADS or the usable CPU count).
+ */
+void qcad_set_num_threads(int n)
+{
+    qcad_config config;
+    qcad_get_config(&config);
+    config.threads = (n > 0) ? n : env_int("QCAD_NUM_THREADS");
+    qcad_configure(&config);
+}
+
+/**
+ * @brief Returns the total number of threads of all groups, starting the pool if needed.
+ */
+int qcad_get_num_threads(void)
+{
+    pthread_once(&pool_once, pool_init);
+    pthread_rwlock_rdlock(&pool.resize);
+    int n = pool.nthreads;
+    pthread_rwlock_unlock(&pool.resize);
+    return n;
+}
+
+/**
+ * @brief Calls fn(ctx, begin, end) over chunks of [0, n) on the pool and returns once every
+ *        chunk is done.
+ *
+ * The range is cut into about POOL_CHUNKS_PER_THREAD chunks per thread, of at least grain
+ * items, and dealt out as one contiguous run per thread, like a static schedule. A thread
+ * that finishes its run steals half of the remaining run of another, so uneven chunks
+ * (border tiles, odd channel counts) and threads busy with another region do not stall
+ * the others. Regions started concurrently from several threads are served by the same
+ * workers. In throughput mode the region runs on the group of the calling thread only.
+ * Loops of fewer than 2 * grain items run serially in the caller.
+ */
+void qcad_parallel_for(int n, int grain, qcad_task_fn fn, void *ctx)
+{
+    if (n <= 0)
+    {
+        return;
+    }
+    grain = (grain < 1) ? 1 : grain;
+    if (n < 2 * grain || in_region)
+    {
+        fn(ctx, 0, n);
+        return;
+    }
+    pthread_once(&pool_once, pool_init);
+    pthread_rwlock_rdlock(&pool.resize);
+    int group = caller_group();
+    int nthreads = pool.group_threads;
+    int chunk = n / (nthreads * POOL_CHUNKS_PER_THREAD);
+    chunk = (chunk < grain) ? grain : chunk;
+    int nchunks = (n + chunk - 1) / chunk;
+    pool_deque deques[nthreads];
+    for (int t = 0; t < nthreads; t++)
+    {
+        unsigned begin = (unsigned)((long long)nchunks * t / nthreads);
+        unsigned end = (unsigned)((long long)nchunks * (t + 1) / nthreads);
+        atomic_init(&deques[t].range, pack_range(begin, end));
+    }
+    pool_job job = {fn, ctx, n, chunk, nthreads, group, deques, 0};
+
+    int slot = -1;
+    if (nthreads > 1)
+    {
+        pthread_mutex_lock(&pool.lock);
+        for (int s = 0; s < POOL_MAX_JOBS && slot < 0; s++)
+        {
+            if (pool.jobs[s] == NULL)
+            {
+                slot = s;
+                pool.jobs[s] = &job;
+                publish();
+            }
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    // The caller owns deque 0; without a free slot it runs every chunk itself
+    in_region = 1;
+    work_on(&job, 0);
+    in_region = 0;
+    if (slot >= 0)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pool.jobs[slot] = NULL;
+        pthread_mutex_unlock(&pool.lock);
+        // Chunks still running belong to registered users
+        for (int i = 0; atomic_load_explicit(&job.users, memory_order_acquire) > 0;)
+        {
+            if (i < POOL_SPIN)
+            {
+                cpu_relax();
+                i++;
+            }
+            else
+            {
+                sched_yield();
+            }
+        }
+    }
+    pthread_rwlock_unlock(&pool.resize);
+}
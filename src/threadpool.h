@@ -0,0 +1,55 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+/*
+ * Persistent worker pool shared by the layers.
+ *
+ * The workers are created once and stay alive between layer calls: after a job they spin
+ * for a while on the job counter, so back-to-back layers start without a system call, and
+ * only then park on a condition variable. A parallel region cuts [0, n) into chunks that
+ * start out as one contiguous run per thread (the calling thread takes the first) and are
+ * rebalanced by work stealing. Regions from several application threads, e.g. concurrent
+ * inferences, run at the same time and share the workers. Regions started from inside a
+ * region run serially in the caller.
+ *
+ * The pool is configured with qcad_configure, or from the environment at first use so that
+ * one binary can run differently per host:
+ *
+ *   QCAD_MODE=latency|throughput  execution mode (qcad_mode), latency by default
+ *   QCAD_NUM_THREADS=n            total threads, by default one per usable CPU
+ *   QCAD_GROUP_THREADS=n          threads per group in throughput mode, 1 by default
+ *   QCAD_CPUS=cpulist             CPUs to run on, e.g. "0-7,16-23", within the affinity mask
+ *   QCAD_PIN=1                    pin every thread to one CPU
+ *   QCAD_AVOID_SMT=1              use one hardware thread per physical core
+ *
+ * The usable CPUs are those of the process's affinity mask (taskset, cpusets) that are in
+ * the cpulist, minus SMT siblings when asked; the default thread count is their number,
+ * capped by the CPU quota of the process's cgroup (see affinity.h).
+ */
+
+/**
+ * @brief Body of a parallel region: processes the items [begin, end).
+ */
+typedef void (*qcad_task_fn)(void *ctx, int begin, int end);
+
+typedef enum {
+    QCAD_LATENCY,   // one inference at a time: every region is split over all threads
+    QCAD_THROUGHPUT // independent inferences: the threads form groups of group_threads, and the
+                    // regions of each calling thread run on its own group
+} qcad_mode;
+
+typedef struct {
+    qcad_mode mode;
+    int threads;       // total threads, calling threads included; 0 for the usable CPU count
+    int group_threads; // QCAD_THROUGHPUT: threads per group; 0 for 1, one inference per core
+    int pin;           // pin each thread to one usable CPU, groups on consecutive CPUs
+    int avoid_smt;     // keep one hardware thread per physical core
+    const char *cpus;  // cpulist restricting the usable CPUs, NULL for the whole affinity mask
+} qcad_config;
+
+void qcad_configure(const qcad_config *config);
+void qcad_get_config(qcad_config *config);
+void qcad_set_num_threads(int n);
+int qcad_get_num_threads(void);
+void qcad_parallel_for(int n, int grain, qcad_task_fn fn, void *ctx);
+#endif // THREADPOOL_H
@@ -10,11 +10,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 // #define USE_MSSE
-#ifdef USE_MSSE
+#if defined(QVECTOR)
+int bitCount(qtype n)
+{
+    int cnt = 0;
+    for (int l = 0; l < QLANES; l++)
+    {
+        cnt += __builtin_popcountll(n[l]);
+    }
+    return cnt;
+}
+#elif defined(USE_MSSE)
 #include <nmmintrin.h>
-#ifdef USE_LONG
+#if QWORD_BITS == 64
 int bitCount(qtype n)
 {
     return _mm_popcnt_u64(n);
@@ -26,7 +37,7 @@ int bitCount(qtype n)
 }
 #endif
 #else
-#ifdef USE_LONG
+#if QWORD_BITS == 64
 int bitCount(qtype n)
 {
     return __builtin_popcountll(n);
@@ -39,11 +50,56 @@ int bitCount(qtype n)
 #endif
 #endif
 
+/**
+ * @brief Random packed word, one rand() per 64-bit lane of a vector word.
+ */
+qtype rand_qword(void)
+{
+#ifdef QVECTOR
+    qtype v;
+    for (int l = 0; l < QLANES; l++)
+    {
+        v[l] = (unsigned long long)rand();
+    }
+    return v;
+#else
+    return (qtype)rand();
+#endif
+}
+
 int sign(int x)
 {
     return (x > 0) - (x < 0);
 }
 
+/**
+ * @brief Largest absolute value of n floats, 0 for n = 0.
+ */
+float abs_max(const float *x, size_t n)
+{
+    // Independent maxima to break the dependency chain
+    float m[8] = {0};
+    float range = 0.0f;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            float a = fabsf(x[i + j]);
+            m[j] = a > m[j] ? a : m[j];
+        }
+    }
+    for (; i < n; i++)
+    {
+        range = fabsf(x[i]) > range ? fabsf(x[i]) : range;
+    }
+    for (int j = 0; j < 8; j++)
+    {
+        range = m[j] > range ? m[j] : range;
+    }
+    return range;
+}
+
 int count_layers(const char *filename)
 {
     FILE *file = fopen(filename, "r");
@@ -71,15 +127,15 @@ int count_layers(const char *filename)
 float *flatto1d(float *input, int input_channel, int input_height, int input_width)
 {
 
-    float *input_linear = (float *)malloc(input_channel * input_height * input_width * sizeof(float));
-    int i = 0;
+    float *input_linear = (float *)malloc((size_t)input_channel * input_height * input_width * sizeof(float));
+    size_t i = 0;
     for (int c = 0; c < input_channel; c++)
     {
         for (int h = 0; h < input_height; h++)
         {
             for (int w = 0; w < input_width; w++)
             {
-                input_linear[i] = input[c * h * w];
+                input_linear[i] = input[((size_t)c * input_height + h) * input_width + w];
                 i += 1;
             }
         }
@@ -87,3 +143,13 @@ float *flatto1d(float *input, int input_channel, int input_height, int input_wid
     free(input);
     return input_linear;
 }
+
+/**
+ * @brief Flattens an (N, channel, height, width) batch into N feature vectors (N, channel *
+ *        height * width) for linear_forward_batch. The features of each image are ordered
+ *        like flatto1d. The input is freed.
+ */
+float *flatto1d_batch(float *inputs, int N, int input_channel, int input_height, int input_width)
+{
+    return flatto1d(inputs, N * input_channel, input_height, input_width);
+}
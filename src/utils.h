@@ -1,41 +1,116 @@
-#include "conv.h"
 #include <stdint.h>
+#include <stddef.h>
 #ifndef UTILS_H
 #define UTILS_H
 #define MAX_CHARS_LINE 1024
 
 #define USE_LONG
 
+/*
+ * Packing word (qtype) width: QWORD_BITS = 32, 64 (USE_LONG, default), 128 or 256, e.g.
+ * make CFLAGS+=-DQWORD_BITS=256. Channels are padded to whole words. 128- and 256-bit words
+ * are GCC vector types, the representation behind __m128i / __m256i, so the bitwise
+ * operators work on the whole word at once; single bits are accessed through QBIT, QTEST
+ * and QMASK, and popcounts through bitCount / qpop.
+ */
+#ifndef QWORD_BITS
 #ifdef USE_LONG
-#define SIZEQUANT 64
-#define qtype long
-#define QFSCAN 0x%lx\n
+#define QWORD_BITS 64
 #else
+#define QWORD_BITS 32
+#endif
+#endif
+
+#if QWORD_BITS == 32
 #define SIZEQUANT 32
 #define qtype int
+#define QONE 1U // unsigned, so shifts into the sign bit are defined
 #define QFSCAN 0x%x\n
-
+#elif QWORD_BITS == 64
+#define SIZEQUANT 64
+#define qtype long
+#define QONE 1UL // unsigned, so shifts into the sign bit are defined
+#define QFSCAN 0x%lx\n
+#elif QWORD_BITS == 128 || QWORD_BITS == 256
+#define SIZEQUANT QWORD_BITS
+#define QVECTOR
+#define QLANES (QWORD_BITS / 64) // 64-bit lanes per word
+// Only 8-byte aligned, so words can live anywhere malloc puts them
+typedef unsigned long long qvector __attribute__((vector_size(QWORD_BITS / 8), aligned(8)));
+#define qtype qvector
+#if QWORD_BITS == 256
+// The whole library is built with the same flags, so GCC's note on passing 256-bit vectors
+// without -mavx (a possible ABI mismatch between objects) does not apply
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+#else
+#error "QWORD_BITS must be 32, 64, 128 or 256"
 #endif
 
 // #define qt int
 
+#ifdef QVECTOR
+static inline qtype qbit(int i)
+{
+    qtype v = {0};
+    v[i / 64] = 1ULL << (i % 64);
+    return v;
+}
+
+static inline qtype qmask(int n)
+{
+    qtype v = {0};
+    for (int l = 0; l < QLANES; l++)
+    {
+        int bits = n - 64 * l;
+        v[l] = (bits >= 64) ? ~0ULL : (bits > 0 ? (1ULL << bits) - 1 : 0);
+    }
+    return v;
+}
 
+#define QBIT(i) qbit(i)
+#define QMASK(n) qmask(n)
+#define QTEST(x, i) ((int)(((x)[(i) / 64] >> ((i) % 64)) & 1))
+#else
+// Single set bit at position i of a packed word
+#define QBIT(i) ((qtype)(QONE << (i)))
+// Bits [0, n) of a packed word, 0 < n < SIZEQUANT
+#define QMASK(n) ((qtype)((QONE << (n)) - 1))
+// Bit i of a packed word, 0 or 1
+#define QTEST(x, i) ((int)(((x) >> (i)) & 1))
+#endif
+
+
+// Ternary word: nz marks nonzero values, sign marks -1 among them (always clear where nz is)
 typedef struct {
-    qtype bit_0;
-    qtype bit_1;
+    qtype nz;
+    qtype sign;
 } ttype;
 
+// Planar ternary block for the GEMM operands (see bgemm.h): TBLOCK_WORDS consecutive words
+// of the nz plane followed by the same words of the sign plane, 256 bits each
+#define TBLOCK_WORDS (256 / SIZEQUANT)
+#define TBLOCKS(words) (((words) + TBLOCK_WORDS - 1) / TBLOCK_WORDS)
+typedef struct {
+    qtype nz[TBLOCK_WORDS];
+    qtype sign[TBLOCK_WORDS];
+} tblock;
+
 typedef enum {
     BNN,
     TBN,
     TNN,
     FP,
-    INT8
+    INT8,
+    MBIT // Bit-serial multi-bit weights and activations, see packed.h
 } quant_type;
 
 int bitCount(qtype n);
+qtype rand_qword(void);
 int sign(int x);
+float abs_max(const float *x, size_t n);
 int count_layers(const char* filename);
 float *flatto1d(float *input, int input_channel, int input_height, int input_width);
+float *flatto1d_batch(float *inputs, int N, int input_channel, int input_height, int input_width);
 
 #endif // UTILS_H
\ No newline at end of file
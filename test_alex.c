@@ -35,7 +35,7 @@ float getRandomNumber()
 int main()
 {
     printf("ALEXXXXXXXXXXXXXXX\n");
-    // omp_set_num_threads(NUM_CPU);
+    // qcad_set_num_threads(NUM_CPU);
     quant_type typ[4] = {FP, TNN, TBN, BNN};
     int len_typ = 4;
     double time_FP;
@@ -81,15 +81,12 @@ int main()
                     }
                 }
             }
-            float *x1 = conv2d_forward(conv1, input, input_height, input_width);
-            float *x1_mp = max_pooling_2d_k(x1, conv1->output_channel, 55, 55, 3, 2);
-            float *x2 = conv2d_forward(conv2, x1_mp, 27, 27);
-            float *x2_mp = max_pooling_2d_k(x2, conv2->output_channel, 27, 27, 3, 2);
+            float *x1_mp = conv2d_pool_forward(conv1, input, input_height, input_width, 3, 2);
+            float *x2_mp = conv2d_pool_forward(conv2, x1_mp, 27, 27, 3, 2);
 
             float *x3 = conv2d_forward(conv3, x2_mp, 13, 13);
             float *x4 = conv2d_forward(conv4, x3, 13, 13);
-            float *x5 = conv2d_forward(conv5, x4, 13, 13);
-            float *x5_mp = max_pooling_2d_k(x5, conv5->output_channel, 13, 13, 3, 2);
+            float *x5_mp = conv2d_pool_forward(conv5, x4, 13, 13, 3, 2);
 
             float *input_linear = flatto1d(x5_mp, 256, 6, 6);
             float *x6 = linear_forward(linear1, input_linear);
@@ -37,7 +37,7 @@ int main()
 {
     printf("LENET\n");
 
-    // omp_set_num_threads(NUM_CPU);
+    // qcad_set_num_threads(NUM_CPU);
     quant_type typ[4] = {FP, TNN, TBN, BNN};
     int len_typ = 4;
     double time_FP;
@@ -37,7 +37,7 @@ int main()
 {
     printf("QCADDDDDDDDDDDDD\n");
 
-    // omp_set_num_threads(NUM_CPU);
+    // qcad_set_num_threads(NUM_CPU);
     quant_type typ[4] = {FP, TNN, TBN, BNN};
     int len_typ = 4;
     double time_FP;
@@ -75,10 +75,9 @@ int main()
                     }
                 }
             }
-            float *x1 = conv2d_forward(conv1, input, input_height, input_width);
-            float *x1_mp = max_pooling_2d(x1, conv1->output_channel, input_height, input_width);
-            float *x2 = conv2d_forward(conv2, x1_mp, input_height/2, input_width/2);
-            float *x2_mp = max_pooling_2d(x2, conv2->output_channel, (input_height/2)/2, (input_width/2)/2);
+            float *x1_mp = conv2d_pool_forward(conv1, input, input_height, input_width, 2, 2);
+            float *x2_mp = conv2d_pool_forward(conv2, x1_mp, input_height/2, input_width/2, 2, 2);
+            free(x2_mp);
 
             // float *input_linear = flatto1d(x2_mp, 64, (input_height/2)/2, (input_height/2)/2);
             // float *x3 = linear_forward(linear1, input_linear);
@@ -17,7 +17,6 @@
 #define NUM_TESTCASES 84000
 // #define NO_TESTS 1
 #define NO_TESTS 1
-#define NUM_CPU 24
 
 int power(int base, int exponent)
 {
@@ -36,7 +35,7 @@ int main()
 {
     printf("VGG16\n");
 
-    omp_set_num_threads(NUM_CPU);
+    // Threads, mode and pinning come from QCAD_NUM_THREADS, QCAD_MODE, ... (see threadpool.h)
     quant_type typ[4] = {FP, TNN, TBN, BNN};
     int len_typ = 4;
     for (int t = 0; t < len_typ; t++)